@@ -0,0 +1,56 @@
+/*
+ * atomic_record.h -- trivially copyable record that may be copied during a write
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/*
+ * atomic_record<T>: a T kept in relaxed atomic words
+ *
+ * Optimistic readers (seqlock, concurrent_hash_map) copy a record without excluding its
+ * writers and throw the copy away if a write overlapped it. Keeping the record in atomic
+ * words makes such a torn copy merely stale rather than a data race. Each word is atomic
+ * on its own; ordering the copy against the writes is up to the caller.
+ */
+template <typename T>
+class atomic_record {
+    static_assert(std::is_trivially_copyable_v<T>, "atomic_record<T> copies T bytewise");
+
+public:
+    atomic_record() = default;      // all bytes zero
+    explicit atomic_record(const T& init) { store(init); }
+
+    atomic_record(const atomic_record&) = delete;
+    atomic_record& operator=(const atomic_record&) = delete;
+
+    T load() const {
+        uint64_t buf[NUM_WORDS];
+        for (size_t i = 0; i < NUM_WORDS; ++i) {
+            buf[i] = words[i].load(std::memory_order_relaxed);
+        }
+        std::array<unsigned char, sizeof(T)> bytes;
+        std::memcpy(bytes.data(), buf, sizeof(T));
+        return std::bit_cast<T>(bytes);
+    }
+
+    void store(const T& value) {
+        uint64_t buf[NUM_WORDS] = {};
+        std::memcpy(buf, &value, sizeof(T));
+        for (size_t i = 0; i < NUM_WORDS; ++i) {
+            words[i].store(buf[i], std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static constexpr size_t NUM_WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> words[NUM_WORDS] = {};
+};
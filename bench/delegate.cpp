@@ -0,0 +1,88 @@
+/*
+ * delegate.cpp -- delegate<T> against a mutex around the same critical section
+ *
+ * THREADS threads each run OPS critical sections that update a shared record of
+ * RECORD_LINES cache lines, first through a delegate, whose server is pinned to one cpu,
+ * then under a mutex, at the number of simulated cpus given on the command line.
+ *
+ *     g++ -std=c++20 -O2 -I.. delegate.cpp <the .cpp files in .. but libcpu.cpp> ../libcpu.o -pthread
+ *     for n in 1 2 4 8; do ./a.out $n; done
+ *
+ * Prints the mean time per critical section with each, including the wait for it.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "delegate.h"
+#include "mutex.h"
+#include "thread.h"
+
+namespace {
+
+constexpr int THREADS = 8;
+constexpr int OPS = 20'000;
+constexpr int RECORD_LINES = 8;
+
+struct record {
+    long words[RECORD_LINES * 8] = {};
+
+    void update(long x) {
+        for (long& w : words) {
+            w += x;
+        }
+    }
+};
+
+unsigned int num_cpus;
+delegate<record>* shared_by_delegate;
+record shared_by_mutex;
+mutex lock;
+
+void delegate_worker(uintptr_t id) {
+    for (int i = 0; i < OPS; ++i) {
+        shared_by_delegate->execute([id](record& r) { r.update(static_cast<long>(id)); });
+    }
+}
+
+void mutex_worker(uintptr_t id) {
+    for (int i = 0; i < OPS; ++i) {
+        lock.lock();
+        shared_by_mutex.update(static_cast<long>(id));
+        lock.unlock();
+    }
+}
+
+// returns the mean ns per critical section of THREADS threads running 'worker'
+double run(thread_startfunc_t worker) {
+    std::vector<std::unique_ptr<thread>> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < THREADS; ++i) {
+        threads.push_back(std::make_unique<thread>(worker, i));
+    }
+    for (auto& t : threads) {
+        t->join();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (double(THREADS) * OPS);
+}
+
+void parent(uintptr_t) {
+    shared_by_delegate = new delegate<record>();
+    double by_delegate = run(delegate_worker);
+    delete shared_by_delegate;
+
+    double by_mutex = run(mutex_worker);
+
+    printf("%u cpus: delegate %.0f ns/op, mutex %.0f ns/op\n", num_cpus, by_delegate, by_mutex);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    num_cpus = argc > 1 ? static_cast<unsigned int>(atoi(argv[1])) : 1;
+    cpu::boot(num_cpus, parent, 0, true, false, 0);
+}
@@ -0,0 +1,74 @@
+/*
+ * hash_map.cpp -- concurrent_hash_map throughput at a given number of simulated cpus
+ *
+ * THREADS threads each run OPS operations on one shared map, FINDS_PER_WRITE finds to an
+ * insert, insert_or_assign or erase, over a key range that starts empty, so the map grows
+ * and migrates while it is read. Timer interrupts are on, as in a real program.
+ *
+ *     g++ -std=c++20 -O2 -I.. hash_map.cpp <the .cpp files in .. but libcpu.cpp> ../libcpu.o -pthread
+ *     for n in 1 2 4 8; do ./a.out $n; done
+ *
+ * Prints the number of cpus and the operations per second across all threads.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "concurrent_hash_map.h"
+#include "thread.h"
+
+namespace {
+
+constexpr int THREADS = 16;
+constexpr long OPS = 200'000;
+constexpr long KEYS = 1 << 18;
+constexpr int FINDS_PER_WRITE = 9;
+
+unsigned int num_cpus;
+concurrent_hash_map<long, long>* map;
+
+void worker(uintptr_t seed) {
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    long found = 0;
+    for (long i = 0; i < OPS; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        long key = static_cast<long>(x % KEYS);
+
+        switch (i % (FINDS_PER_WRITE + 1)) {
+        case 0:  map->insert(key, key); break;
+        case 1:  map->insert_or_assign(key, i); break;
+        case 2:  map->erase(key); break;
+        default: found += map->find(key).has_value(); break;
+        }
+    }
+    (void) found;
+}
+
+void parent(uintptr_t) {
+    map = new concurrent_hash_map<long, long>();
+    std::vector<std::unique_ptr<thread>> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < THREADS; ++i) {
+        threads.push_back(std::make_unique<thread>(worker, i + 1));
+    }
+    for (auto& t : threads) {
+        t->join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("%u cpus: %.2f Mops/s (%zu keys)\n", num_cpus, THREADS * OPS / elapsed.count() / 1e6, map->size());
+    delete map;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    num_cpus = argc > 1 ? static_cast<unsigned int>(atoi(argv[1])) : 1;
+    cpu::boot(num_cpus, parent, 0, true, false, 0);
+}
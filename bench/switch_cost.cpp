@@ -0,0 +1,77 @@
+/*
+ * switch_cost.cpp -- context-switch cost with and without cpu_heap's huge-page arena and
+ * the dispatch prefetch
+ *
+ * THREADS threads on one cpu each yield ROUNDS times, so every switch lands on another
+ * thread's stack and TCB; with 1000 threads those span more pages than the dTLB covers.
+ * Timer interrupts are off, so every switch is a thread::yield().
+ *
+ *     g++ -std=c++20 -O2 -I.. switch_cost.cpp <the .cpp files in .. but libcpu.cpp> ../libcpu.o -pthread
+ *     ./a.out                    # ordinary pages
+ *     ./a.out huge               # cpu_heap::huge_pages
+ *     ./a.out noprefetch         # cpu::switch_prefetch cleared; combines with huge
+ *
+ * Prints the backing cpu_heap got, whether dispatches prefetched, and the mean time per switch.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "cpu_heap.h"
+#include "thread.h"
+
+namespace {
+
+constexpr int THREADS = 1000;
+constexpr int ROUNDS = 200;
+
+const char* backing_name(cpu_heap::Backing b) {
+    switch (b) {
+    case cpu_heap::Backing::HUGETLB: return "hugetlbfs";
+    case cpu_heap::Backing::THP:     return "transparent huge pages";
+    case cpu_heap::Backing::PAGES:   return "ordinary pages (no huge pages available)";
+    default:                         return "ordinary pages";
+    }
+}
+
+void worker(uintptr_t) {
+    // touch a little stack, as a real thread would between switches
+    volatile char frame[2048];
+    for (int i = 0; i < ROUNDS; ++i) {
+        frame[i] = static_cast<char>(i);
+        thread::yield();
+    }
+    (void) frame[0];
+}
+
+void parent(uintptr_t) {
+    std::vector<std::unique_ptr<thread>> threads;
+    for (int i = 0; i < THREADS; ++i) {
+        threads.push_back(std::make_unique<thread>(worker, 0));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto& t : threads) {
+        t->join();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("%s, %s: %.1f ns/switch\n", backing_name(cpu_heap::backing()),
+           cpu::switch_prefetch ? "prefetch" : "no prefetch", elapsed.count() / (double(THREADS) * ROUNDS));
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "huge") == 0) {
+            cpu_heap::huge_pages = true;
+        } else if (strcmp(argv[i], "noprefetch") == 0) {
+            cpu::switch_prefetch = false;
+        }
+    }
+    cpu::boot(1, parent, 0, false, false, 0);
+}
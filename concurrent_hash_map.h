@@ -0,0 +1,355 @@
+/*
+ * concurrent_hash_map.h -- open-addressing hash map with lock-free reads
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <type_traits>
+
+#include "atomic_record.h"
+#include "cpu.h"
+#include "rcu.h"
+#include "spinlock.h"
+
+/*
+ * concurrent_hash_map<K, V, Hash>: a hash map of trivially copyable keys and values shared by
+ * many threads
+ *
+ * Entries live inline in one array of slots with linear probing, so a lookup usually reads
+ * one or two cache lines. A slot goes EMPTY -> BUSY -> FULL when a key is inserted and FULL ->
+ * DELETED when it is erased; a slot is never reused for another key, so a key read from a
+ * FULL slot stays valid. Tombstones are dropped by the next resize.
+ *
+ * Writers of a key serialize on one of NUM_STRIPES spinlocks, chosen by the key's hash, and
+ * bump the stripe's sequence number to odd and back around each change. Readers take no
+ * lock: they probe inside an RCU read section and copy the value, retrying if the key's
+ * stripe sequence number changed meanwhile, as a seqlock reader does. Writers hold the
+ * stripe with preemption disabled, so a reader spins for one write at most.
+ *
+ * Once more than 3/4 of the newest table's slots have been claimed, the next writer links a
+ * new table behind it (twice as large unless tombstones make up the difference); an insert
+ * that finds the newest table full links one itself. Every writer then moves MIGRATE_CHUNK
+ * slots of the oldest table before its own change. Each entry is moved with its stripe held,
+ * and its old slot becomes MOVED, as do the old table's free slots, so no insert can land
+ * behind the migration. Until a table is fully moved, lookups search it and every table
+ * after it, and inserts go to the newest. The writer that moves the last chunk makes the
+ * next table the root, whose own migration starts if it has a successor, and frees the old
+ * one through rcu::call().
+ */
+template <typename K, typename V, typename Hash = std::hash<K>>
+class concurrent_hash_map {
+    static_assert(std::is_trivially_copyable_v<K> && std::is_default_constructible_v<K>, "keys are copied out of slots bytewise");
+    static_assert(std::is_trivially_copyable_v<V>, "values are copied out of slots bytewise");
+
+public:
+    explicit concurrent_hash_map(size_t capacity = MIN_CAPACITY)
+        : root(new table(std::bit_ceil(std::max(capacity, MIN_CAPACITY)))) {}
+
+    // no thread may use the map meanwhile
+    ~concurrent_hash_map() {
+        table* t = root.load(std::memory_order_relaxed);
+        while (t) {
+            table* next = t->next.load(std::memory_order_relaxed);
+            delete t;
+            t = next;
+        }
+    }
+
+    concurrent_hash_map(const concurrent_hash_map&) = delete;
+    concurrent_hash_map& operator=(const concurrent_hash_map&) = delete;
+
+    std::optional<V> find(const K& key) const {
+        uint64_t h = mix(key);
+        const stripe& s = stripes[h & (NUM_STRIPES - 1)];
+        std::optional<V> result;
+
+        rcu::read_lock();
+        for (;;) {
+            uint32_t before = s.seq.load(std::memory_order_acquire);
+            if ((before & 1) == 0) {
+                slot* found = lookup(h, key);
+                result = found ? std::optional<V>(found->value.load()) : std::nullopt;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (s.seq.load(std::memory_order_relaxed) == before) {
+                    break;
+                }
+            }
+            cpu_relax();
+        }
+        rcu::read_unlock();
+        return result;
+    }
+
+    bool contains(const K& key) const { return find(key).has_value(); }
+
+    /*
+     * MODIFIES: the map
+     *
+     * inserts key unless it is present; returns whether it was inserted
+     */
+    bool insert(const K& key, const V& value) {
+        return write(key, [&](uint64_t h, slot* found) {
+            if (found) {
+                return false;
+            }
+            place(h, key, value);
+            count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        });
+    }
+
+    /*
+     * MODIFIES: the map
+     *
+     * inserts key or overwrites its value; returns whether it was inserted
+     */
+    bool insert_or_assign(const K& key, const V& value) {
+        return write(key, [&](uint64_t h, slot* found) {
+            if (found) {
+                found->value.store(value);
+                return false;
+            }
+            place(h, key, value);
+            count.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        });
+    }
+
+    /*
+     * MODIFIES: the map
+     *
+     * removes key; returns whether it was present
+     */
+    bool erase(const K& key) {
+        return write(key, [&](uint64_t, slot* found) {
+            if (!found) {
+                return false;
+            }
+            found->state.store(DELETED, std::memory_order_release);
+            count.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        });
+    }
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+    static constexpr size_t MIN_CAPACITY = 64;
+    static constexpr unsigned int STRIPE_BITS = 6;
+    static constexpr size_t NUM_STRIPES = size_t{1} << STRIPE_BITS;
+    static constexpr size_t MIGRATE_CHUNK = 64;
+
+private:
+    enum : uint8_t {EMPTY = 0, BUSY, FULL, DELETED, MOVED};
+
+    struct slot {
+        std::atomic<uint8_t> state{EMPTY};
+        K key{};                            // written before the slot turns FULL, never after
+        atomic_record<V> value;
+    };
+
+    struct table {
+        explicit table(size_t capacity)
+            : mask(capacity - 1), shift(64 - std::countr_zero(capacity)), slots(new slot[capacity]) {}
+
+        size_t capacity() const { return mask + 1; }
+        bool migrated() const { return migrate_done.load(std::memory_order_acquire) == capacity(); }
+
+        const size_t mask;
+        const unsigned int shift;           // a key's first slot is the top bits of its hash
+        std::unique_ptr<slot[]> slots;
+        std::atomic<size_t> used{0};        // slots claimed for a key, tombstones included
+        std::atomic<table*> next{nullptr};  // the table this one is being moved to
+        std::atomic<size_t> migrate_claimed{0};
+        std::atomic<size_t> migrate_done{0};
+    };
+
+    struct alignas(64) stripe {
+        spinlock lock;
+        std::atomic<uint32_t> seq{0};       // odd while a writer holds the lock
+    };
+
+    // Fibonacci hashing, as std::hash is the identity for integers
+    uint64_t mix(const K& key) const { return uint64_t(hasher(key)) * 0x9E3779B97F4A7C15ULL; }
+
+    static void begin_write(stripe& s) {
+        s.lock.lock();
+        s.seq.store(s.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    static void end_write(stripe& s) {
+        s.seq.store(s.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        s.lock.unlock();
+    }
+
+    /*
+     * runs op(hash, slot of key or nullptr) with key's stripe held, after helping any
+     * migration along, and returns its result
+     */
+    template <typename Op>
+    bool write(const K& key, Op&& op) {
+        uint64_t h = mix(key);
+        stripe& s = stripes[h & (NUM_STRIPES - 1)];
+
+        rcu::read_lock();
+        table* retired = help_migrate();
+        begin_write(s);
+        bool result = op(h, lookup(h, key));
+        end_write(s);
+        grow();
+        rcu::read_unlock();
+
+        if (retired) {
+            rcu::call(&free_table, reinterpret_cast<uintptr_t>(retired));
+        }
+        return result;
+    }
+
+    // the FULL slot holding key in any table not yet fully moved, or nullptr
+    slot* lookup(uint64_t h, const K& key) const {
+        for (table* t = root.load(std::memory_order_acquire); t; t = t->next.load(std::memory_order_acquire)) {
+            if (t->migrated()) {
+                continue;
+            }
+            size_t i = h >> t->shift;
+            for (size_t probes = 0; probes <= t->mask; ++probes, i = (i + 1) & t->mask) {
+                slot& sl = t->slots[i];
+                uint8_t state = sl.state.load(std::memory_order_acquire);
+                if (state == EMPTY) {
+                    break;
+                }
+                if (state == FULL && sl.key == key) {
+                    return &sl;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    table* newest() const {
+        table* t = root.load(std::memory_order_acquire);
+        while (table* next = t->next.load(std::memory_order_acquire)) {
+            t = next;
+        }
+        return t;
+    }
+
+    /*
+     * INVARIANT:
+     *              called with key's stripe held, key absent
+     *
+     * claims a free slot for key in the newest table
+     */
+    void place(uint64_t h, const K& key, const V& value) {
+        table* t = newest();
+        for (;;) {
+            size_t i = h >> t->shift;
+            for (size_t probes = 0; probes <= t->mask; ++probes, i = (i + 1) & t->mask) {
+                slot& sl = t->slots[i];
+                uint8_t state = sl.state.load(std::memory_order_relaxed);
+                if (state == EMPTY && sl.state.compare_exchange_strong(state, BUSY, std::memory_order_acquire)) {
+                    sl.key = key;
+                    sl.value.store(value);
+                    sl.state.store(FULL, std::memory_order_release);
+                    t->used.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                if (state == MOVED) {
+                    break;      // a migration started meanwhile; insert behind it
+                }
+            }
+            // the newest table filled up before a writer grew it, e.g. while it took a chunk
+            table* next = t->next.load(std::memory_order_acquire);
+            t = next ? next : link_successor(t);
+        }
+    }
+
+    // links a larger table behind the newest once that is 3/4 claimed
+    void grow() {
+        table* t = newest();
+        if (t->used.load(std::memory_order_relaxed) > t->capacity() / 4 * 3) {
+            link_successor(t);
+        }
+    }
+
+    // returns the table behind t, linking a new one unless another writer got there first
+    table* link_successor(table* t) {
+        // without enough live entries to need more room, the same size sheds the tombstones
+        bool crowded = count.load(std::memory_order_relaxed) >= t->capacity() / 2;
+        table* fresh = new table(crowded ? t->capacity() * 2 : t->capacity());
+        table* expected = nullptr;
+        if (!t->next.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+            delete fresh;
+            return expected;
+        }
+        return fresh;
+    }
+
+    /*
+     * moves one chunk of the root table if a migration is under way; returns the old table
+     * if this finished the migration. Only the root is ever moved, so a chain of tables is
+     * moved oldest first.
+     */
+    table* help_migrate() {
+        table* t = root.load(std::memory_order_acquire);
+        if (!t->next.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        size_t begin = t->migrate_claimed.fetch_add(MIGRATE_CHUNK, std::memory_order_relaxed);
+        if (begin >= t->capacity()) {
+            return nullptr;
+        }
+        size_t end = std::min(begin + MIGRATE_CHUNK, t->capacity());
+        for (size_t i = begin; i < end; ++i) {
+            migrate_slot(t->slots[i]);
+        }
+
+        if (t->migrate_done.fetch_add(end - begin, std::memory_order_acq_rel) + (end - begin) == t->capacity()) {
+            root.store(t->next.load(std::memory_order_relaxed), std::memory_order_release);
+            return t;
+        }
+        return nullptr;
+    }
+
+    void migrate_slot(slot& sl) {
+        for (;;) {
+            uint8_t state = sl.state.load(std::memory_order_acquire);
+            if (state == EMPTY || state == DELETED) {
+                if (sl.state.compare_exchange_weak(state, MOVED, std::memory_order_acq_rel)) {
+                    return;
+                }
+            } else if (state == BUSY) {
+                cpu_relax();     // an insert in progress, with preemption disabled
+            } else {
+                // FULL: moved by the key's writer protocol, so readers retry around it
+                uint64_t h = mix(sl.key);
+                stripe& s = stripes[h & (NUM_STRIPES - 1)];
+                begin_write(s);
+                bool moved = sl.state.load(std::memory_order_relaxed) == FULL;
+                if (moved) {
+                    place(h, sl.key, sl.value.load());
+                    sl.state.store(MOVED, std::memory_order_release);
+                }
+                end_write(s);
+                if (moved) {
+                    return;
+                }
+            }
+        }
+    }
+
+    static void free_table(uintptr_t t) { delete reinterpret_cast<table*>(t); }
+
+    [[no_unique_address]] Hash hasher;
+    std::atomic<table*> root;
+    std::atomic<size_t> count{0};
+    stripe stripes[NUM_STRIPES];
+};
@@ -1,8 +1,20 @@
 // WORKING code for the cpu class
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "cpu.h"
+#include "deadlock_detector.h"
+#include "numa.h"
+#include "rcu.h"
+#include "sched_log.h"
+#include "sched_stats.h"
+#include "stack_watermark.h"
 #include "thread.h"
 
 /***************************************************************************************************
@@ -10,12 +22,83 @@
  ***************************************************************************************************/
 
  // TCB constructor
-TCB::TCB() : 
+TCB::TCB() : TCB(cpu::num_threads++) {
+    if (cpu::tracking_threads()) {
+        cpu::all_threads.insert(this);
+    }
+} // TCB()
+
+TCB::TCB(uint32_t id) : 
     status(Status::Null),  
-    id(cpu::num_threads++), 
-    stk(std::make_unique_for_overwrite<char[]>(STACK_SIZE)),
-    uc(std::make_shared<ucontext_t>())
-{} // TCB()
+    id(id), 
+    quantum(cpu::default_quantum),
+    node(numa::current_node()),
+    stk(numa::alloc_stack(node), numa::stack_deleter{node}),
+    uc(std::allocate_shared<ucontext_t>(numa::allocator<ucontext_t>(node)))
+{
+    if (stack_watermark::enabled) {
+        stack_watermark::fill(stk.get(), STACK_SIZE);
+    }
+} // TCB(id)
+
+TCB::~TCB() {
+    if (cpu::tracking_threads()) {
+        cpu::all_threads.erase(this);
+    }
+} // ~TCB()
+
+std::shared_ptr<TCB> TCB::create() {
+    return std::allocate_shared<TCB>(numa::allocator<TCB>(numa::current_node()));
+} // TCB::create()
+
+std::shared_ptr<TCB> TCB::create(uint32_t id) {
+    return std::allocate_shared<TCB>(numa::allocator<TCB>(numa::current_node()), id);
+} // TCB::create(id)
+
+void TCB::set_status(Status next) {
+    uint64_t now = cpu::clock_ns();
+    uint64_t elapsed = now - status_since;
+
+    switch (status) {
+    case Status::RUNNING:
+        times.running_ns += elapsed;
+        sched_stats::record(sched_stats::TIME_SLICE, elapsed);
+        break;
+    case Status::READY:
+        times.ready_ns += elapsed;
+        sched_stats::record(sched_stats::DISPATCH_LATENCY, elapsed);
+        break;
+    case Status::BLOCKED:
+        times.blocked_ns += elapsed;
+        break;
+    default:
+        break;
+    }
+
+    if (next == Status::RUNNING) {
+        slice_left = quantum;
+    }
+    if (status == Status::BLOCKED) {
+        stk_reclaimed = false;
+    }
+
+    status = next;
+    status_since = now;
+} // TCB::set_status()
+
+thread_times TCB::current_times() const {
+    thread_times t = times;
+    uint64_t elapsed = cpu::clock_ns() - status_since;
+
+    if (status == Status::RUNNING) {
+        t.running_ns += elapsed;
+    } else if (status == Status::READY) {
+        t.ready_ns += elapsed;
+    } else if (status == Status::BLOCKED) {
+        t.blocked_ns += elapsed;
+    }
+    return t;
+} // TCB::current_times()
 
 /***************************************************************************************************
  *                                           Kernel Guard                                          *
@@ -25,6 +108,23 @@ TCB::TCB() :
 kernel_guard::kernel_guard() {
     cpu::interrupt_disable();
     cpu::guard_acquire();
+
+    // Library calls are the points where a replay preempts threads (see sched_log.h)
+    if (sched_log::mode != sched_log::Mode::OFF) {
+        cpu* self = cpu::current();
+        auto curr = self->curr_thread.get();
+        if (curr && curr != self->suspended_thread.get()) {
+            if (sched_log::mode == sched_log::Mode::REPLAY && sched_log::preempt_recorded(curr->id, curr->sync_ops)) {
+                // a thread in a preempt_disable() section is preempted when it leaves it
+                if (cpu::preempt_count == 0) {
+                    thread::internal_yield();
+                } else {
+                    cpu::preempt_pending = true;
+                }
+            }
+            ++curr->sync_ops;
+        }
+    }
 } // kernel_guard()
 
 // Enables interrupts
@@ -56,14 +156,22 @@ user_guard::~user_guard() {
 bool cpu::booted = false;
 unsigned int cpu::num_cpus = 0;
 unsigned int cpu::num_threads = 0;
+unsigned int cpu::default_quantum = 1;
+
+uint64_t cpu::clock_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+} // cpu::clock_ns()
 
 void cpu::guard_acquire() {
     assert_interrupts_disabled();
     while (guard.exchange(true)) {}
+    guard_held = true;
 } // cpu::guard_acquire()
 
 void cpu::guard_release() {
     assert_interrupts_disabled();
+    guard_held = false;
     guard.store(false);
 } // cpu::guard_release()
 
@@ -81,15 +189,42 @@ void cpu::guard_release() {
 void cpu::ipi_handler() {
     cpu::interrupt_disable();
     cpu::guard_acquire();
+    cpu* self = cpu::current();
+
+    sched_stats::record(sched_stats::IPI_LATENCY, cpu::clock_ns() - self->ipi_sent_ns.load(std::memory_order_relaxed));
+
+    // give the owners of any runnext threads RUNNEXT_STEAL_NS to dispatch them themselves;
+    // this cpu is idle and runs on its own stack, so it can let go of the guard meanwhile.
+    // Once the ready counts change, an owner has taken its runnext or a thread was readied,
+    // so the slots are looked at again under the guard rather than waiting out the window
+    while (cpu::ready_threads.empty() && self->pinned_ready.empty() && cpu::num_ready.load(std::memory_order_relaxed) != 0) {
+        uint64_t newest = 0;
+        for (cpu* c : cpu::cpus) {
+            if (c->runnext) {
+                newest = std::max(newest, c->runnext->status_since);
+            }
+        }
+        uint64_t deadline = newest + RUNNEXT_STEAL_NS;
+        unsigned int seen = cpu::num_ready.load(std::memory_order_relaxed);
+        if (cpu::clock_ns() >= deadline) {
+            break;
+        }
+
+        cpu::guard_release();
+        while (cpu::clock_ns() < deadline && cpu::num_ready.load(std::memory_order_relaxed) == seen
+               && self->num_pinned.load(std::memory_order_relaxed) == 0) {
+            cpu_relax();
+        }
+        cpu::guard_acquire();
+    }
     
-    if (!cpu::ready_threads.empty()) {
-        auto prev = cpu::self()->curr_thread;
-        cpu::self()->curr_thread = cpu::ready_threads.front();
-        cpu::ready_threads.pop();
+    if (cpu::work_for(self)) {
+        auto prev = self->curr_thread;
+        self->curr_thread = cpu::pop_ready();
 
-        assert(cpu::self()->curr_thread->status == Status::READY);
-        cpu::self()->curr_thread->status = Status::RUNNING;
-        swapcontext(prev->uc.get(), cpu::self()->curr_thread->uc.get());
+        assert(self->curr_thread->status == Status::READY);
+        self->curr_thread->set_status(Status::RUNNING);
+        swapcontext(prev->uc.get(), self->curr_thread->uc.get());
     }
 } // cpu::ipi_handler()
 
@@ -98,20 +233,105 @@ void cpu::ipi_handler() {
  * otherwise, the currently running thread will continue
  */
 void cpu::timer_interrupt_handler() {
-    {
-        kernel_guard kg;
-        if (cpu::self()->curr_thread == cpu::self()->suspended_thread) {
-            return;
+    cpu::interrupt_disable();
+    cpu* self = cpu::current();
+
+    // Only this cpu changes its curr_thread, so it can be read without the guard while
+    // interrupts are disabled
+    TCB* curr = self->curr_thread.get();
+
+    // a tick outside a read section is a quiescent state for RCU; only taken when a grace
+    // period is waiting for this cpu
+    if (cpu::preempt_count == 0 && curr != self->suspended_thread.get() && self->rcu_qs_needed.load(std::memory_order_relaxed)) {
+        cpu::guard_acquire();
+        rcu::quiescent(self);
+        cpu::guard_release();
+    }
+
+    // the clock-paced checks and stack reclaim run on whichever tick finds them due, whether
+    // or not this tick preempts anything
+    uint64_t now = cpu::clock_ns();
+    if (deadlock_detector::due(now) || sched_stats::due(now) || cpu::reclaim_due(now)) {
+        cpu::guard_acquire();
+        deadlock_detector::tick();
+        sched_stats::tick();
+        cpu::reclaim_stacks();
+        cpu::guard_release();
+    }
+
+    if (curr == self->suspended_thread.get()) {
+        cpu::interrupt_enable();
+        return;
+    }
+
+    // the thread keeps the cpu until its time slice runs out; the slice is used up whether
+    // or not another thread is waiting
+    bool slice_over = curr->slice_left <= 1;
+    if (!slice_over) {
+        --curr->slice_left;
+    }
+
+    // tickless: with no thread waiting for a cpu there is nothing to preempt for, and a stale
+    // count only delays a preemption by one tick
+    if (!slice_over || !cpu::work_for(self)) {
+        cpu::interrupt_enable();
+        return;
+    }
+
+    // the thread is preempted when it leaves its preempt_disable() section; in a replay the
+    // recorded library calls decide instead
+    if (cpu::preempt_count != 0) {
+        if (sched_log::mode != sched_log::Mode::REPLAY) {
+            cpu::preempt_pending = true;
         }
+        cpu::interrupt_enable();
+        return;
     }
 
-    // printf("\t\t\t\t(TIMER ISR): cpu<%d> thread<%d> interrupted by timer, calling thread yield\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-    thread::yield();
+    cpu::guard_acquire();
+
+    // when replaying, threads are preempted at the recorded library calls instead (see kernel_guard)
+    if (sched_log::mode != sched_log::Mode::REPLAY) {
+        cpu::preempt_pending = false;
+        if (cpu::ready_here()) {
+            sched_log::log(sched_log::Event::PREEMPT, self->cpu_id, curr->id, curr->sync_ops);
+        }
+
+        // printf("\t\t\t\t(TIMER ISR): cpu<%d> thread<%d> interrupted by timer, calling thread yield\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+        thread::internal_yield();
+    }
+
+    cpu::guard_release();
+    cpu::interrupt_enable();
 } // cpu::timer_interrupt_handler()
 
+/*
+ * The deferred preemption is logged like a timer preemption, at the library call count the
+ * thread has reached, so a replay preempts it at its next library call
+ */
+void cpu::preempt_resched() {
+    cpu::interrupt_disable();
+    cpu::guard_acquire();
+    cpu* self = cpu::current();
+
+    rcu::quiescent(self);
+
+    if (cpu::preempt_pending) {
+        cpu::preempt_pending = false;
+        if (sched_log::mode != sched_log::Mode::REPLAY && cpu::ready_here()) {
+            TCB* curr = self->curr_thread.get();
+            sched_log::log(sched_log::Event::PREEMPT, self->cpu_id, curr->id, curr->sync_ops);
+        }
+        thread::internal_yield();
+    }
+
+    cpu::guard_release();
+    cpu::interrupt_enable();
+} // cpu::preempt_resched()
+
 /*
  * MODIFIES:
- *              cpu::self()->curr_thread
+ *              cpu::current()->curr_thread
  *
  * a cpu is suspended everytime there are no available threads in the ready queue
  *
@@ -120,20 +340,23 @@ void cpu::timer_interrupt_handler() {
  */
 void cpu::suspend_cpu() {   
     assert_interrupts_disabled(); 
-    if (cpu::self()->curr_thread) {
-        // printf("\t\t\t\t(SUSPEND): swapping context from current cpu<%d> thread<%d>  to suspend_ctx\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-        auto prev = cpu::self()->curr_thread;
-        cpu::self()->curr_thread = cpu::self()->suspended_thread;
-
-        assert(cpu::self()->curr_thread && cpu::self()->curr_thread->uc.get());
-        assert(cpu::self()->curr_thread->stk.get());
+    cpu* self = cpu::current();
+    if (self->curr_thread) {
+        // printf("\t\t\t\t(SUSPEND): swapping context from current cpu<%d> thread<%d>  to suspend_ctx\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+        // a raw pointer: a finished thread never resumes to drop a reference held here, and
+        // a blocked one is kept alive by whatever it is blocked on
+        TCB* prev = self->curr_thread.get();
+        self->curr_thread = self->suspended_thread;
+
+        assert(self->curr_thread && self->curr_thread->uc.get());
+        assert(self->curr_thread->stk.get());
         assert(prev);
         assert(prev->uc.get());
-        swapcontext(prev->uc.get(), cpu::self()->curr_thread->uc.get());
+        swapcontext(prev->uc.get(), self->curr_thread->uc.get());
     } else {
         // printf("\t\t\t\tcpu starting without a thread, and no threads are available, suspending\n");
-        cpu::self()->curr_thread = cpu::self()->suspended_thread;
-        setcontext(cpu::self()->curr_thread->uc.get());
+        self->curr_thread = self->suspended_thread;
+        setcontext(self->curr_thread->uc.get());
     }
 } // cpu::suspend_cpu()
 
@@ -141,7 +364,31 @@ void cpu::suspend_helper() {
     while (true) {
         assert_interrupts_disabled();
         
-        sleeping_cpus.push(cpu::self());
+        if (cpu::stack_reclaim) {
+            cpu::reclaim_stacks();
+        }
+
+        // an idle cpu holds no RCU readers, and runs the callbacks of ended grace periods;
+        // either can make threads ready, which this cpu then runs instead of going to sleep
+        cpu* self = cpu::current();
+        rcu::quiescent(self);
+        rcu::run_callbacks();
+        if (cpu::work_for(self)) {
+            auto prev = self->curr_thread;
+            self->curr_thread = cpu::pop_ready();
+            self->curr_thread->set_status(Status::RUNNING);
+            swapcontext(prev->uc.get(), self->curr_thread->uc.get());
+            continue;
+        }
+
+        sleeping_cpus.push(self);
+
+        // the infrastructure ends the process once every cpu is idle, without running atexit handlers
+        if (sleeping_cpus.size() == num_cpus) {
+            sched_log::flush();
+            deadlock_detector::check();
+            cpu::check_hang();
+        }
 
         cpu::guard_release();
         cpu::interrupt_enable_suspend();
@@ -149,6 +396,98 @@ void cpu::suspend_helper() {
 }
 
 
+/*
+ * INVARIANT:
+ *              called with interrupts disabled and the cpu guard held
+ *
+ * drops the dead part of the stacks of threads blocked for longer than stack_reclaim_ns
+ *
+ * the guard keeps the threads from being dispatched (and growing their stacks again) while
+ * their pages are dropped, and a thread that is BLOCKED while it is held has finished saving
+ * its context; passes are spaced RECLAIM_INTERVAL_NS apart since idle cpus pass through here
+ * on every suspend and busy ones on every tick
+ */
+void cpu::reclaim_stacks() {
+    assert_interrupts_disabled();
+
+    uint64_t now = cpu::clock_ns();
+    if (!cpu::reclaim_due(now)) {
+        return;
+    }
+    cpu::reclaim_last_ns.store(now, std::memory_order_relaxed);
+    if (stack_watermark::enabled) {
+        return;
+    }
+
+    // the saved stack pointer is only known where the context layout is
+#if defined(__x86_64__) && defined(REG_RSP)
+    static constexpr uintptr_t RED_ZONE = 128; // bytes below the stack pointer a leaf function may use
+
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    for (TCB* t : cpu::all_threads) {
+        if (t->status != Status::BLOCKED || t->stk_reclaimed || now - t->status_since < cpu::stack_reclaim_ns) {
+            continue;
+        }
+
+        uintptr_t bottom = reinterpret_cast<uintptr_t>(t->stk.get());
+        uintptr_t sp = static_cast<uintptr_t>(t->uc->uc_mcontext.gregs[REG_RSP]);
+        assert(sp > bottom && sp <= bottom + STACK_SIZE);
+
+        // only whole pages strictly inside the stack buffer, below the live frames
+        uintptr_t lo = (bottom + page - 1) & ~(page - 1);
+        uintptr_t hi = (sp - RED_ZONE) & ~(page - 1);
+        if (hi > lo) {
+            madvise(reinterpret_cast<void*>(lo), hi - lo, MADV_DONTNEED);
+        }
+        t->stk_reclaimed = true;
+    }
+#endif
+} // cpu::reclaim_stacks()
+
+/*
+ * INVARIANT:
+ *              called by the last cpu to go idle, with the cpu guard held
+ *
+ * reports (and optionally aborts on) user threads that are BLOCKED forever
+ */
+void cpu::check_hang() {
+    assert_interrupts_disabled();
+
+    if (!cpu::hang_watchdog) {
+        return;
+    }
+
+    std::vector<TCB*> threads(cpu::all_threads.begin(), cpu::all_threads.end());
+    std::sort(threads.begin(), threads.end(), [](TCB* a, TCB* b) { return a->id < b->id; });
+
+    auto blocked = std::count_if(threads.begin(), threads.end(), [](TCB* t) { return t->status == Status::BLOCKED; });
+    if (blocked == 0) {
+        return;
+    }
+
+    static constexpr const char* status_names[] = {"NULL", "READY", "RUNNING", "BLOCKED", "FINISHED"};
+
+    std::fprintf(stderr, "HANG: every cpu is idle but %zu threads are blocked\n", static_cast<size_t>(blocked));
+    for (TCB* t : threads) {
+        std::fprintf(stderr, "    thread %u: %s, joined by:", t->id, status_names[static_cast<uint8_t>(t->status)]);
+
+        // walk the join queue by rotating it a full turn
+        if (t->join_q.empty()) {
+            std::fprintf(stderr, " none");
+        }
+        for (size_t i = 0; i < t->join_q.size(); ++i) {
+            std::fprintf(stderr, " %u", t->join_q.front()->id);
+            t->join_q.push(t->join_q.front());
+            t->join_q.pop();
+        }
+        std::fprintf(stderr, "\n");
+    }
+
+    if (cpu::hang_abort) {
+        std::abort();
+    }
+} // cpu::check_hang()
+
 /*
  * for multiprocessors, everytime a thread becomes ready a running cpu will send an IPI 
  * to a sleeping cpu from the 'sleeping_cpu' queue 
@@ -157,23 +496,56 @@ void cpu::suspend_helper() {
  */
 void cpu::fetch_cpu() {
     assert_interrupts_disabled();
+    cpu* self = cpu::current();
 
     if (!cpu::sleeping_cpus.empty()) {
         auto next_cpu = sleeping_cpus.front();
         sleeping_cpus.pop();
 
-        assert(next_cpu != cpu::self());
+        assert(next_cpu != self);
         assert(next_cpu->curr_thread == next_cpu->suspended_thread);
-        assert(next_cpu->curr_thread != cpu::self()->suspended_thread);
+        assert(next_cpu->curr_thread != self->suspended_thread);
     
-        // printf("\t\t\t\t(KERNEL): <cpu %d> waking up CPU %d through an interprocessor interrupt\n", cpu::self()->cpu_id, next_cpu->cpu_id);
+        // printf("\t\t\t\t(KERNEL): <cpu %d> waking up CPU %d through an interprocessor interrupt\n", cpu::current()->cpu_id, next_cpu->cpu_id);
+        auto sender = self->curr_thread; // null while a cpu is still booting
+        sched_log::log(sched_log::Event::IPI, next_cpu->cpu_id, sender ? sender->id : TCB::IDLE_ID, self->cpu_id);
     
+        next_cpu->ipi_sent_ns.store(cpu::clock_ns(), std::memory_order_relaxed);
         next_cpu->interrupt_send();
     }
 }
 
 /*
- * (MODIFIES) cpu::self()->curr_thread 
+ * sleeping_cpus holds at most num_cpus cpus, so taking 'target' out of the middle by cycling
+ * through the queue is cheap
+ */
+void cpu::fetch_cpu(cpu* target) {
+    assert_interrupts_disabled();
+    cpu* self = cpu::current();
+
+    bool sleeping = false;
+    for (size_t n = cpu::sleeping_cpus.size(); n > 0; --n) {
+        cpu* c = cpu::sleeping_cpus.front();
+        cpu::sleeping_cpus.pop();
+        if (c == target) {
+            sleeping = true;
+        } else {
+            cpu::sleeping_cpus.push(c);
+        }
+    }
+    if (!sleeping) {
+        return;
+    }
+
+    auto sender = self->curr_thread;
+    sched_log::log(sched_log::Event::IPI, target->cpu_id, sender ? sender->id : TCB::IDLE_ID, self->cpu_id);
+
+    target->ipi_sent_ns.store(cpu::clock_ns(), std::memory_order_relaxed);
+    target->interrupt_send();
+} // cpu::fetch_cpu()
+
+/*
+ * (MODIFIES) cpu::current()->curr_thread 
  *
  * begin_process is the function called by all cpu's in their cpu constructor
  *
@@ -189,14 +561,14 @@ void cpu::fetch_cpu() {
  *
  */
  void cpu::begin_process() {
-    if (!cpu::ready_threads.empty()) {
+    cpu* self = cpu::current();
+    if (cpu::work_for(self)) {
 
-        cpu::self()->curr_thread = cpu::ready_threads.front();
-        cpu::ready_threads.pop();
+        self->curr_thread = cpu::pop_ready();
         
-        assert(cpu::self()->curr_thread.get());
-        cpu::self()->curr_thread->status = Status::RUNNING;
-        setcontext(cpu::self()->curr_thread->uc.get());
+        assert(self->curr_thread.get());
+        self->curr_thread->set_status(Status::RUNNING);
+        setcontext(self->curr_thread->uc.get());
     } else {
         cpu::suspend_cpu();
     }
@@ -212,23 +584,24 @@ void cpu::fetch_cpu() {
 void cpu::get_next_thread() {
 
     assert_interrupts_disabled();
+    assert(cpu::preempt_count == 0 && "blocked inside a preempt_disable() section");
+    cpu* self = cpu::current();
 
-    if (!cpu::ready_threads.empty()) {
-        assert(cpu::self()->curr_thread.get());
+    if (cpu::work_for(self)) {
+        assert(self->curr_thread.get());
 
-        auto prev                   = cpu::self()->curr_thread; // current thread running
-        cpu::self()->curr_thread    = cpu::ready_threads.front(); // next thread to run 
+        auto prev                   = self->curr_thread; // current thread running
+        self->curr_thread    = cpu::pop_ready(); // next thread to run 
 
-        assert(cpu::self()->curr_thread.get());
-        cpu::ready_threads.pop();
+        assert(self->curr_thread.get());
         
-        assert(cpu::self()->curr_thread->status == Status::READY);
+        assert(self->curr_thread->status == Status::READY);
         assert(prev->status == Status::BLOCKED);
        
-        // printf("\t\t\t\t(THREAD YIELD) <cpu %d> swappping context from thread %d to thread %d\n", cpu::self()->cpu_id, prev->id, cpu::self()->curr_thread->id);
+        // printf("\t\t\t\t(THREAD YIELD) <cpu %d> swappping context from thread %d to thread %d\n", cpu::current()->cpu_id, prev->id, cpu::current()->curr_thread->id);
        
-        cpu::self()->curr_thread->status = Status::RUNNING;
-        swapcontext(prev->uc.get(), cpu::self()->curr_thread->uc.get());
+        self->curr_thread->set_status(Status::RUNNING);
+        swapcontext(prev->uc.get(), self->curr_thread->uc.get());
         assert_interrupts_disabled();
 
         cpu::clear_finished_threads(prev);
@@ -237,6 +610,165 @@ void cpu::get_next_thread() {
     } 
 } // cpu::get_next_thread()
 
+/*
+ * INVARIANT:
+ *              work_for(cpu::current()) must be true
+ *
+ * removes and returns the next thread to run
+ *
+ * threads pinned to this cpu go first, then this cpu's runnext, unless they went first
+ * RUNNEXT_LIMIT times in a row while threads waited in the queue; another cpu's runnext is
+ * only taken when the queue is empty, which ready_here() rules out for a cpu that is not
+ * going idle
+ *
+ * when replaying, the recorded thread is taken from wherever it is: this cpu's pinned threads,
+ * the queue or any runnext slot; otherwise, with a NUMA topology, the first of the next
+ * numa::LOOKAHEAD threads homed on this cpu's node is taken, falling back to the front of
+ * the queue
+ */
+std::shared_ptr<TCB> cpu::pop_ready() {
+    assert_interrupts_disabled();
+    assert(cpu::work_for(cpu::current()));
+    assert(cpu::preempt_count == 0 && "switched out inside a preempt_disable() section");
+    cpu* self = cpu::current();
+
+    // the thread this cpu ran last is not in a read section any more
+    rcu::quiescent(self);
+
+    uint32_t want;
+    if (sched_log::mode == sched_log::Mode::REPLAY && sched_log::next_dispatch(want)) {
+        auto is_wanted = [want](const std::shared_ptr<TCB>& t) { return t->id == want; };
+        auto pinned = std::find_if(self->pinned_ready.begin(), self->pinned_ready.end(), is_wanted);
+        if (pinned != self->pinned_ready.end()) {
+            auto next = *pinned;
+            self->pinned_ready.erase(pinned);
+            self->num_pinned.fetch_sub(1, std::memory_order_relaxed);
+            cpu::prefetch_next_in_line(self);
+            return next;
+        }
+        auto found = std::find_if(cpu::ready_threads.begin(), cpu::ready_threads.end(), is_wanted);
+        if (found != cpu::ready_threads.end()) {
+            auto next = *found;
+            cpu::ready_threads.erase(found);
+            cpu::num_ready.fetch_sub(1, std::memory_order_relaxed);
+            cpu::prefetch_next_in_line(self);
+            return next;
+        }
+        for (cpu* c : cpu::cpus) {
+            if (c->runnext && is_wanted(c->runnext)) {
+                auto next = std::move(c->runnext);
+                cpu::num_ready.fetch_sub(1, std::memory_order_relaxed);
+                cpu::prefetch_next_in_line(self);
+                return next;
+            }
+        }
+        ++sched_log::divergences;
+    }
+
+    bool own_turn = self->runnext_streak < RUNNEXT_LIMIT || cpu::ready_threads.empty();
+    if (!self->pinned_ready.empty() && own_turn) {
+        auto next = std::move(self->pinned_ready.front());
+        self->pinned_ready.pop_front();
+        self->num_pinned.fetch_sub(1, std::memory_order_relaxed);
+        if (!cpu::ready_threads.empty()) {
+            ++self->runnext_streak;
+        }
+        sched_log::log(sched_log::Event::DISPATCH, self->cpu_id, next->id, next->sync_ops);
+        cpu::prefetch_next_in_line(self);
+        return next;
+    }
+
+    cpu* slot = nullptr;
+    if (self->runnext && own_turn) {
+        slot = self;
+        if (!cpu::ready_threads.empty()) {
+            ++self->runnext_streak;
+        }
+    } else if (cpu::ready_threads.empty() && cpu::num_ready.load(std::memory_order_relaxed) != 0) {
+        auto owner = std::find_if(cpu::cpus.begin(), cpu::cpus.end(), [](cpu* c) { return c->runnext != nullptr; });
+        assert(owner != cpu::cpus.end());
+        slot = *owner;
+    }
+    if (slot) {
+        auto next = std::move(slot->runnext);
+        cpu::num_ready.fetch_sub(1, std::memory_order_relaxed);
+        sched_log::log(sched_log::Event::DISPATCH, self->cpu_id, next->id, next->sync_ops);
+        cpu::prefetch_next_in_line(self);
+        return next;
+    }
+    self->runnext_streak = 0;
+
+    auto pick = cpu::ready_threads.begin();
+    if (numa::enabled()) {
+        unsigned int here = numa::node_of(self->cpu_id);
+        size_t window = std::min(cpu::ready_threads.size(), numa::LOOKAHEAD);
+        auto local = std::find_if(cpu::ready_threads.begin(), cpu::ready_threads.begin() + window,
+                                  [here](const std::shared_ptr<TCB>& t) { return t->node == here; });
+        if (local != cpu::ready_threads.begin() + window) {
+            pick = local;
+        }
+    }
+
+    auto next = *pick;
+    cpu::ready_threads.erase(pick);
+    cpu::num_ready.fetch_sub(1, std::memory_order_relaxed);
+
+    sched_log::log(sched_log::Event::DISPATCH, self->cpu_id, next->id, next->sync_ops);
+    cpu::prefetch_next_in_line(self);
+    return next;
+} // cpu::pop_ready()
+
+/*
+ * The thread this cpu will most likely dispatch next, a pinned thread, its runnext or else the
+ * front of the queue, usually waits a whole time slice. Loading its context and stack now, one dispatch
+ * ahead, lets its own switch find them in cache: the TCB, the saved registers, FPU state
+ * pointer and signal mask, the FPU state itself, and the lines around the saved stack
+ * pointer, which that switch returns through. Following the TCB's and the context's pointers
+ * stalls this dispatch instead, which was going to take the same misses on 'next' anyway.
+ *
+ * Prefetches are only hints: they never fault, whatever the address.
+ */
+void cpu::prefetch_next_in_line(cpu* self) {
+    static constexpr size_t LINE = 64;
+
+    if (!switch_prefetch) {
+        return;
+    }
+    const TCB* t = !self->pinned_ready.empty() ? self->pinned_ready.front().get()
+                 : self->runnext ? self->runnext.get()
+                 : cpu::ready_threads.empty() ? nullptr : cpu::ready_threads.front().get();
+    if (!t) {
+        return;
+    }
+    __builtin_prefetch(t);
+    __builtin_prefetch(reinterpret_cast<const char*>(t) + LINE);
+
+    const ucontext_t* uc = t->uc.get();
+    const char* regs = reinterpret_cast<const char*>(&uc->uc_mcontext);
+    const char* regs_end = reinterpret_cast<const char*>(&uc->uc_sigmask + 1);
+    for (const char* line = regs; line < regs_end; line += LINE) {
+        __builtin_prefetch(line);
+    }
+
+#if defined(__x86_64__) && defined(REG_RSP)
+    static constexpr int STACK_LINES = 4;
+
+    __builtin_prefetch(uc->uc_mcontext.fpregs);
+
+    // one line below the stack pointer for the frames the thread pushes first
+    const char* sp = reinterpret_cast<const char*>(uc->uc_mcontext.gregs[REG_RSP]);
+    for (int i = -1; i < STACK_LINES - 1; ++i) {
+        __builtin_prefetch(sp + i * static_cast<ptrdiff_t>(LINE), 1);
+    }
+#endif
+} // cpu::prefetch_next_in_line()
+
+bool cpu::ready_here() {
+    assert_interrupts_disabled();
+    cpu* self = cpu::current();
+    return !self->pinned_ready.empty() || self->runnext || !cpu::ready_threads.empty();
+} // cpu::ready_here()
+
 /*
  * MODIFIES: thread->status to Status::READY
  * 
@@ -246,19 +778,79 @@ void cpu::push_to_queue(const std::shared_ptr<TCB>& thread) {
 
     assert_interrupts_disabled();
 
-    // printf("\t\t\t\t(KERNEL): cpu<%d> pushing thread<%d> onto the ready queue\n", cpu::self()->cpu_id, thread->id);
+    if (thread->pinned) {
+        cpu::push_pinned(thread);
+        return;
+    }
+
+    // printf("\t\t\t\t(KERNEL): cpu<%d> pushing thread<%d> onto the ready queue\n", cpu::current()->cpu_id, thread->id);
 
     assert(thread.get() && "the thread being pushed to queue was a null pointer\n");
     assert(thread->status != Status::FINISHED && "A finished thread attempted to be enqeued onto the ready ready\n");
     assert(thread->status != Status::READY && "the thread being pushed to the ready queue has been enqueued\n");
     assert(thread->status == Status::RUNNING || thread->status == Status::BLOCKED || thread->status == Status::Null);
 
-    thread->status = Status::READY;
-    cpu::ready_threads.push(thread);
+    thread->set_status(Status::READY);
+    cpu::ready_threads.push_back(thread);
+    cpu::num_ready.fetch_add(1, std::memory_order_relaxed);
 
     cpu::fetch_cpu();
 } // cpu::push_to_queue() 
 
+/*
+ * MODIFIES: thread->status to Status::READY
+ *
+ * A pinned thread waits for its own cpu only: that cpu is woken if it sleeps, and otherwise
+ * dispatches the thread at its next switch. Its timer interrupt sees num_pinned, so a thread
+ * running there is still preempted for it.
+ */
+void cpu::push_pinned(const std::shared_ptr<TCB>& thread) {
+    assert_interrupts_disabled();
+    assert(thread->pinned);
+    assert(thread->status == Status::RUNNING || thread->status == Status::BLOCKED);
+
+    cpu* home = thread->pinned;
+    thread->set_status(Status::READY);
+    home->pinned_ready.push_back(thread);
+    home->num_pinned.fetch_add(1, std::memory_order_relaxed);
+
+    if (home != cpu::current()) {
+        cpu::fetch_cpu(home);
+    }
+} // cpu::push_pinned()
+
+/*
+ * MODIFIES: thread->status to Status::READY
+ *
+ * Readies a thread woken by the running thread on this cpu's runnext slot
+ *
+ * A sleeping cpu is still woken, so a waker that keeps running cannot hold the woken
+ * thread back while other cpus are idle; it waits RUNNEXT_STEAL_NS before stealing it
+ */
+void cpu::wake_thread(const std::shared_ptr<TCB>& thread) {
+    assert_interrupts_disabled();
+
+    // pinned threads have a queue of their own
+    if (thread->pinned) {
+        cpu::push_to_queue(thread);
+        return;
+    }
+
+    assert(thread.get() && "the thread being woken was a null pointer\n");
+    assert(thread->status == Status::BLOCKED);
+
+    cpu* self = cpu::current();
+    if (self->runnext) {
+        cpu::ready_threads.push_back(std::move(self->runnext));
+    }
+
+    thread->set_status(Status::READY);
+    self->runnext = thread;
+    cpu::num_ready.fetch_add(1, std::memory_order_relaxed);
+
+    cpu::fetch_cpu();
+} // cpu::wake_thread()
+
 /*
  * MODIFIES: cpu::finished_threads by clearing it 
  * 
@@ -268,12 +860,12 @@ void cpu::push_to_queue(const std::shared_ptr<TCB>& thread) {
 void cpu::clear_finished_threads(const std::shared_ptr<TCB>& curr) {
     assert_interrupts_disabled();
 
-    // printf("\t\t\t\t(KERNEL): cpu<%d> thread<%d> clearing all finished threads\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-    for (auto finished_thread : cpu::finished_threads) {
+    // printf("\t\t\t\t(KERNEL): cpu<%d> thread<%d> clearing all finished threads\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+    for (const auto& finished_thread : cpu::finished_threads) {
         assert(finished_thread->status == Status::FINISHED);
         assert(finished_thread.get() != curr.get());
-        finished_thread.reset();
     }
+    cpu::finished_threads.clear();
 }
 
 /*
@@ -286,17 +878,20 @@ void cpu::clear_finished_threads(const std::shared_ptr<TCB>& curr) {
  */
 cpu::cpu(thread_startfunc_t func, uintptr_t arg) {
     assert_interrupts_disabled();
+    current_cpu = this;
     cpu::guard_acquire();
 
     booted = true;
     
     cpu_id = num_cpus++;
+    stats = std::make_unique<sched_stats>();
+    cpus.push_back(this);
     // printf("\t\t\t\t(KERNEL): cpu<%d> created in cpu::cpu\n", cpu_id);
     
     interrupt_vector_table[TIMER]   = cpu::timer_interrupt_handler;
     interrupt_vector_table[IPI]     = cpu::ipi_handler;
 
-    suspended_thread = std::make_shared<TCB>();
+    suspended_thread = TCB::create(TCB::IDLE_ID - cpu_id);
     makecontext(suspended_thread->uc.get(),
                 suspended_thread->stk.get(),
                 STACK_SIZE,
@@ -305,7 +900,7 @@ cpu::cpu(thread_startfunc_t func, uintptr_t arg) {
 
                 // cpu creates the first thread
     if (func != nullptr) {
-        auto first_thread = std::make_shared<TCB>();
+        auto first_thread = TCB::create();
 
         makecontext(first_thread->uc.get(), 
                     first_thread->stk.get(), 
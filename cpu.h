@@ -17,6 +17,7 @@
 #endif
 
 #include <atomic>
+#include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <source_location>
@@ -25,13 +26,22 @@
 /*
  * Added libraries 
  */
+#include <deque>
 #include <queue>
 #include <memory>
+#include <unordered_set>
 #include <vector>
 
+#include "cpu_heap.h"
+#include "numa.h"
+#include "sched_stats.h"
+
 using interrupt_handler_t = void (*)();
 using thread_startfunc_t = void (*)(uintptr_t);
 
+class cpu;
+class thread_group;
+
 // RAII handling of interrupts
 class kernel_guard {
 public:
@@ -72,21 +82,72 @@ public:
  */
 enum class Status : uint8_t {Null = 0, READY, RUNNING, BLOCKED, FINISHED};
 
+/*
+ * Cumulative time a thread has spent in each state, in nanoseconds of the monotonic clock
+ *
+ * ready_ns is the time spent on the ready queue, from cpu::push_to_queue() until a cpu
+ * dispatched the thread
+ */
+struct thread_times {
+    uint64_t running_ns = 0;
+    uint64_t ready_ns = 0;
+    uint64_t blocked_ns = 0;
+};
+
 /* 
  * Thread Control Block (TCB)
  * 
  * Contains a stack allocated of STACK_SIZE
  * Contains a ucontext_t pointer of the thread's context
+ *
+ * The TCB, its stack and its context are allocated on the NUMA node of the cpu creating
+ * the thread (see numa.h), so TCBs are made with TCB::create()
  * 
  */
 struct TCB {
     TCB(); // TCB constructor
+    explicit TCB(uint32_t id); // TCB constructor for threads that do not take a user thread id
+    ~TCB();
+
+    static std::shared_ptr<TCB> create();
+    static std::shared_ptr<TCB> create(uint32_t id);
+
+    /*
+     * Idle (suspended) threads are numbered down from IDLE_ID so that user thread ids
+     * only depend on the order user threads are created in, not on the order cpus boot in
+     */
+    static constexpr uint32_t IDLE_ID = UINT32_MAX;
+
+    /*
+     * MODIFIES: status, times, status_since, slice_left, stk_reclaimed
+     *
+     * Every status change goes through here so the time spent in the previous status can be 
+     * charged to the thread; time on the ready queue and time slices are also recorded in the
+     * executing cpu's sched_stats
+     */
+    void set_status(Status next);
+
+    /*
+     * returns the thread's accumulated times, including the time spent so far in its current status
+     */
+    thread_times current_times() const;
 
     Status status; // status of the TCB
     uint32_t id; // process id of the TCB
-    std::unique_ptr<char[]> stk;
+    uint32_t quantum; // length of the thread's time slice, in timer interrupts
+    uint32_t slice_left = 0; // timer interrupts left before the thread is preempted
+    bool stk_reclaimed = false; // the dead part of the stack was returned to the OS while BLOCKED
+    uint32_t sync_ops = 0; // number of library calls made, counted while sched_log is recording or replaying
+    unsigned int node; // NUMA node the thread's memory is on
+    cpu* pinned = nullptr; // the only cpu that may run the thread, once it called thread::pin()
+    std::unique_ptr<char[], numa::stack_deleter> stk;
     std::shared_ptr<ucontext_t> uc;
-    std::queue<std::shared_ptr<TCB>> join_q; 
+    std::queue<std::shared_ptr<TCB>, std::deque<std::shared_ptr<TCB>, cpu_heap::allocator<std::shared_ptr<TCB>>>> join_q; 
+    std::shared_ptr<TCB> parked_next; // next thread in the same parking_lot queue, while BLOCKED on a mutex or cv
+    thread_group* group = nullptr; // group to notify when the thread finishes, if any
+    thread_times times; // time spent in each status before the current one
+    thread_times* final_times = nullptr; // where the totals are left when the thread finishes, while its thread object exists
+    uint64_t status_since = 0; // cpu::clock_ns() when the current status was entered
 }; 
 
 class cpu {
@@ -155,6 +216,15 @@ public:
     static cpu* self();                 // returns pointer to the cpu that
                                         // the calling thread is running on
 
+    /*
+     * the thread library's cpu::self(): the executing cpu, cached per host thread by cpu::cpu()
+     * and read inline with a single %fs-relative load instead of a call into the infrastructure
+     *
+     * A thread can resume on a different cpu after any context switch, so a cpu* fetched before
+     * blocking, yielding, or running user code must be fetched again afterwards
+     */
+    static cpu* current() { return current_cpu; }
+
     /*
      * The infrastructure provides an atomic guard variable, which thread
      * libraries should use to provide mutual exclusion on multiprocessors.
@@ -188,11 +258,76 @@ public:
     static void ipi_handler(); 
 
     /*
-     * if a thread is available, the cpu will preempt the thread and run the next available thread
+     * if a thread is available and the current thread's time slice has run out, the cpu will 
+     * preempt the thread and run the next available thread
      * otherwise, the currently running thread will continue
+     *
+     * ticks that cannot lead to a preemption return without taking the cpu guard
      */
     static void timer_interrupt_handler();
 
+    /*
+     * Preemption control for user code (see rcu.h): between preempt_disable() and the matching
+     * preempt_enable() the running thread keeps its cpu. A timer interrupt that would preempt it
+     * sets preempt_pending instead, and the outermost preempt_enable() yields. It also reports
+     * a quiescent state if an RCU grace period is waiting for the cpu. The thread must not
+     * block or yield in between. Sections nest; both are called with interrupts enabled.
+     *
+     * The count belongs to the cpu, not the thread: a thread is only switched out, and can
+     * only move to another cpu, while it is 0. Only this cpu's own interrupt handlers read it,
+     * so it is updated without disabling interrupts (which takes a global lock in libcpu.o);
+     * the signal fences keep the section's accesses inside the count's update.
+     */
+    static void preempt_disable() {
+        ++preempt_count;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+
+    static void preempt_enable() {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        assert(preempt_count > 0);
+        if (--preempt_count != 0) {
+            return;
+        }
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if (preempt_pending || current_cpu->rcu_qs_needed.load(std::memory_order_relaxed)) {
+            cpu::preempt_resched();
+        }
+    }
+
+    // leaves a deferred preemption to the next tick; for sections that may run with the cpu
+    // guard held, which preempt_resched() would take
+    static void preempt_enable_no_resched() {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        assert(preempt_count > 0);
+        --preempt_count;
+    }
+
+    /*
+     * preempt_enable() for sections that are also entered with the cpu guard held or on host
+     * threads that are not cpus (see cpu_heap.h): only there is the deferred preemption left
+     * to the next tick, and the quiescent state to the next tick or dispatch
+     */
+    static void preempt_enable_anywhere() {
+        if (guard_held || !current_cpu) {
+            preempt_enable_no_resched();
+        } else {
+            preempt_enable();
+        }
+    }
+
+    /*
+     * performs the preemption, and reports the quiescent state, deferred while preempt_count
+     * was nonzero
+     */
+    static void preempt_resched();
+
+    inline static thread_local uint32_t preempt_count __attribute__((tls_model("initial-exec"))) = 0;
+    inline static thread_local bool preempt_pending __attribute__((tls_model("initial-exec"))) = false;
+
+    // this cpu holds the guard; it stays with the cpu across the switches it is handed over in
+    inline static thread_local bool guard_held __attribute__((tls_model("initial-exec"))) = false;
+
     /*
      * a cpu is suspended everytime there are no available threads in the ready queue
      *
@@ -210,6 +345,9 @@ public:
      * if there are no cpu's sleeping, the function returns
      */
     static void fetch_cpu();
+
+    // wakes 'target' with an IPI if it is sleeping
+    static void fetch_cpu(cpu* target);
     /*
      * (MODIFIES) cpu::self()->curr_thread 
      *
@@ -236,14 +374,63 @@ public:
      * if there are no available threads, then the cpu will suspend
      */
     static void get_next_thread();
+
+    /*
+     * INVARIANT:
+     *              work_for(cpu::current()) must be true
+     *
+     * removes and returns the next thread to run: a thread pinned to this cpu, else this
+     * cpu's runnext, else the ready queue, else (when this cpu is going idle) another cpu's
+     * runnext
+     *
+     * every dispatch goes through here, so this is where scheduling decisions are
+     * recorded and, when replaying a recording, where they are forced
+     */
+    static std::shared_ptr<TCB> pop_ready();
+
+    /*
+     * starts loading what the switch to the thread 'self' will likely dispatch next reads
+     * first
+     */
+    static void prefetch_next_in_line(cpu* self);
+
+    /*
+     * returns true if this cpu has a thread to switch to without stealing another cpu's runnext
+     */
+    static bool ready_here();
+
+    /*
+     * returns true if 'c' has a thread it may dispatch, in the ready queue, a runnext slot
+     * or its own pinned_ready; readable without the cpu guard
+     */
+    static bool work_for(const cpu* c) {
+        return num_ready.load(std::memory_order_relaxed) != 0 || c->num_pinned.load(std::memory_order_relaxed) != 0;
+    }
     
     /*
      * MODIFIES: thread->status to Status::READY
      * 
-     * Pushes a thread onto the ready queue 
+     * Pushes a thread onto the ready queue, or onto its cpu's pinned_ready if it is pinned
      */
     static void push_to_queue(const std::shared_ptr<TCB>& thread);
 
+    /*
+     * MODIFIES: thread->status to Status::READY
+     *
+     * Pushes a pinned thread onto its cpu's pinned_ready and wakes that cpu if it sleeps
+     */
+    static void push_pinned(const std::shared_ptr<TCB>& thread);
+
+    /*
+     * MODIFIES: thread->status to Status::READY
+     *
+     * Readies a thread woken by the running thread (wake-affine): it goes into this cpu's 
+     * runnext slot to run next here while its data is still in this cpu's cache, and a thread
+     * already in the slot moves to the back of the ready queue. For a pinned thread this is
+     * push_to_queue()
+     */
+    static void wake_thread(const std::shared_ptr<TCB>& thread);
+
     /*
      * MODIFIES: cpu::finished_threads by clearing it 
      * 
@@ -262,25 +449,152 @@ public:
      * INVARIANT:
      *              All cpus that are sleeping must have 'curr_thread' set to nullptr
      */
-    inline static std::queue<cpu*> sleeping_cpus; 
+    inline static std::queue<cpu*, std::deque<cpu*, cpu_heap::allocator<cpu*>>> sleeping_cpus; 
 
     /*
      * INVARIANT: 
      *              All threads in ready_threads must have status READY
+     *
+     * threads are pushed at the back; pop_ready() usually takes the front, but may take
+     * one a few places further in (see numa.h and sched_log.h)
+     */
+    inline static std::deque<std::shared_ptr<TCB>, cpu_heap::allocator<std::shared_ptr<TCB>>> ready_threads; 
+
+    /*
+     * INVARIANT:
+     *              equal to ready_threads.size() plus the number of occupied runnext slots;
+     *              readable without the cpu guard
      */
-    inline static std::queue<std::shared_ptr<TCB>> ready_threads; 
+    inline static std::atomic<unsigned int> num_ready{0};
+
+    /*
+     * time slice of new threads, in timer interrupts; configured before cpu::boot()
+     * a thread is preempted on the quantum-th timer interrupt after it was dispatched, or on
+     * the first one after that which finds another thread ready (see work_for())
+     */
+    static unsigned int default_quantum;
 
     std::shared_ptr<TCB> curr_thread; 
     std::shared_ptr<TCB> suspended_thread; 
+
+    /*
+     * INVARIANT:
+     *              null, or a thread with status READY that is not in ready_threads
+     *
+     * The runnext slot is dispatched before the ready queue, except after RUNNEXT_LIMIT
+     * dispatches from it in a row while threads wait in the queue, so a pair of threads
+     * waking each other cannot starve the queue. A cpu going idle steals other cpus'
+     * runnext; a cpu woken by an IPI first leaves it to its owner for RUNNEXT_STEAL_NS,
+     * since the waker usually blocks right after waking it.
+     */
+    std::shared_ptr<TCB> runnext;
+    uint32_t runnext_streak = 0; // dispatches from runnext or pinned_ready in a row while ready_threads was not empty
+    static constexpr uint32_t RUNNEXT_LIMIT = 8;
+    static constexpr uint64_t RUNNEXT_STEAL_NS = 5'000;
+
+    /*
+     * INVARIANT:
+     *              threads with status READY pinned to this cpu, in the order they became ready;
+     *              num_pinned is their number, readable without the cpu guard
+     *
+     * Only this cpu dispatches them, so they are in neither ready_threads nor num_ready.
+     * They go before runnext and share its RUNNEXT_LIMIT, so pinned threads waking each
+     * other cannot starve the queue either.
+     */
+    std::deque<std::shared_ptr<TCB>, cpu_heap::allocator<std::shared_ptr<TCB>>> pinned_ready;
+    std::atomic<unsigned int> num_pinned{0};
     
     static unsigned int num_threads;
     static unsigned int num_cpus; 
 
     unsigned int cpu_id;
 
+    std::unique_ptr<sched_stats> stats; // latency histograms of this cpu
+    std::atomic<bool> rcu_qs_needed{false}; // the current RCU grace period waits for this cpu (see rcu.h)
+    std::atomic<uint64_t> ipi_sent_ns{0}; // cpu::clock_ns() when the last IPI to this cpu was sent
+
+    /*
+     * Hang watchdog, configured before cpu::boot()
+     *
+     * When the last cpu goes idle while user threads are still BLOCKED, nothing can ever
+     * wake them: this library has no timers or I/O that could. If hang_watchdog is set, the
+     * last cpu to go idle then dumps the state and join queue of every user thread to
+     * stderr, and aborts if hang_abort is also set.
+     */
+    inline static bool hang_watchdog = false;
+    inline static bool hang_abort = false;
+
+    /*
+     * Switch prefetch, configured before cpu::boot()
+     *
+     * If switch_prefetch is set, every dispatch starts loading what the switch to the next
+     * thread in line reads first (see prefetch_next_in_line()). bench/switch_cost.cpp times
+     * switches with and without it.
+     */
+    inline static bool switch_prefetch = true;
+
+    /*
+     * Stack reclaim, configured before cpu::boot()
+     *
+     * If stack_reclaim is set, idle cpus return the unused part of the stacks of threads that
+     * have been BLOCKED for at least stack_reclaim_ns to the OS. Everything below the thread's
+     * saved stack pointer is dead, so those pages are dropped with madvise(MADV_DONTNEED) and 
+     * fault back in as zero pages if the thread ever grows its stack that far again. Passes
+     * run at most every RECLAIM_INTERVAL_NS, from idle cpus and from timer interrupts. The
+     * saved stack pointer is only read on x86-64 glibc; elsewhere nothing is reclaimed.
+     * Nothing is reclaimed either while stacks come from cpu_heap's huge-page arena, where
+     * dropping part of a huge page would split it.
+     */
+    inline static bool stack_reclaim = false;
+    inline static uint64_t stack_reclaim_ns = 60'000'000'000;
+    static constexpr uint64_t RECLAIM_INTERVAL_NS = 100'000'000;
+
+    /*
+     * INVARIANT:
+     *              contains every user thread's TCB while tracking_threads() is true
+     */
+    inline static std::unordered_set<TCB*> all_threads;
+    static bool tracking_threads() { return hang_watchdog || stack_reclaim; }
+
+    /*
+     * INVARIANT:
+     *              called with interrupts disabled and the cpu guard held
+     *
+     * drops the dead part of the stacks of threads blocked for longer than stack_reclaim_ns
+     */
+    static void reclaim_stacks();
+
+    // a reclaim pass at 'now' is due; needs no guard
+    static bool reclaim_due(uint64_t now) {
+        bool huge_stacks = cpu_heap::huge_pages && !numa::enabled();
+        return stack_reclaim && !huge_stacks
+            && now - reclaim_last_ns.load(std::memory_order_relaxed) >= RECLAIM_INTERVAL_NS;
+    }
+    inline static std::atomic<uint64_t> reclaim_last_ns{0};
+
+    /*
+     * INVARIANT:
+     *              called by the last cpu to go idle, with the cpu guard held
+     *
+     * reports (and optionally aborts on) user threads that are BLOCKED forever
+     */
+    static void check_hang();
+
+    /*
+     * returns the monotonic clock in nanoseconds; used for per-thread time accounting
+     */
+    static uint64_t clock_ns();
+
+    /*
+     * INVARIANT:
+     *              contains every cpu that has been initialized; only modified with the cpu guard held
+     */
+    inline static std::vector<cpu*> cpus;
+
     static bool booted;
     bool suspended = false;
 private:    
+    inline static thread_local cpu* current_cpu __attribute__((tls_model("initial-exec"))) = nullptr;
 };
 
 static_assert(sizeof(cpu) <= 2048);
@@ -294,6 +608,19 @@ static_assert(offsetof(cpu, interrupt_vector_table) == 0);
  */
 void makecontext(ucontext_t *ucp, char* stack, unsigned int stack_size, void (*func)(), int argc, ...);
 
+/*
+ * cpu_relax() goes in the body of a spin-wait loop: it tells the host processor the caller
+ * is spinning, which leaves more of the core to a sibling hyperthread and avoids a pipeline
+ * flush when the loop exits. It does nothing where there is no such hint.
+ */
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
 /*
  * assert_interrupts_disabled() and assert_interrupts_enabled() can be used
  * as error checks inside the thread library.  They will assert (i.e. abort
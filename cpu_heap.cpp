@@ -0,0 +1,259 @@
+// WORKING code for the cpu_heap class
+
+#include <bit>
+#include <cassert>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "cpu_heap.h"
+#include "thread.h"
+
+/***************************************************************************************************
+ *                                             CPU Heap                                            *
+ ***************************************************************************************************/
+
+thread_local cpu_heap::free_list cpu_heap::lists[NUM_CLASSES + 1] __attribute__((tls_model("initial-exec")));
+cpu_heap::depot cpu_heap::depots[NUM_CLASSES + 1];
+cpu_heap::arena cpu_heap::huge;
+
+unsigned int cpu_heap::class_of(size_t bytes) {
+    if (bytes <= 128) {
+        return bytes == 0 ? 0 : (bytes - 1) / 16;
+    }
+    // 2^(b-1) < bytes <= 2^b: the class of 3 * 2^(b-2) bytes, or the one of 2^b
+    unsigned int b = std::bit_width(bytes - 1);
+    return 8 + (b - 8) * 2 + (bytes > (size_t{3} << (b - 2)) ? 1 : 0);
+} // cpu_heap::class_of()
+
+size_t cpu_heap::size_of(unsigned int cls) {
+    if (cls < 8) {
+        return (cls + 1) * 16;
+    }
+    unsigned int b = 8 + (cls - 8) / 2;
+    return (cls - 8) % 2 == 0 ? size_t{3} << (b - 2) : size_t{1} << b;
+} // cpu_heap::size_of()
+
+void* cpu_heap::alloc(size_t bytes) {
+    if (bytes > MAX_SIZE) {
+        return ::operator new(bytes);
+    }
+    unsigned int cls = class_of(bytes);
+    return pop(cls, size_of(cls), BATCH);
+} // cpu_heap::alloc()
+
+void cpu_heap::free(void* p, size_t bytes) {
+    if (bytes > MAX_SIZE) {
+        ::operator delete(p);
+        return;
+    }
+    push(p, class_of(bytes), BATCH);
+} // cpu_heap::free()
+
+char* cpu_heap::alloc_stack() {
+    return static_cast<char*>(pop(STACK_CLASS, STACK_SIZE, STACK_BATCH));
+} // cpu_heap::alloc_stack()
+
+void cpu_heap::free_stack(char* stk) {
+    push(stk, STACK_CLASS, STACK_BATCH);
+} // cpu_heap::free_stack()
+
+/*
+ * The caller may hold the cpu guard, which preempt_enable() would take, so a preemption
+ * that fell due meanwhile is only taken here in user code (see cpu::preempt_enable_anywhere())
+ */
+void* cpu_heap::pop(unsigned int cls, size_t size, unsigned int batch) {
+    cpu::preempt_disable();
+    free_list& list = lists[cls];
+    if (!list.head && !refill(list, cls, size, batch)) {
+        cpu::preempt_enable_anywhere();
+        throw std::bad_alloc();
+    }
+    void* p = list.head;
+    list.head = *static_cast<void**>(p);
+    --list.count;
+    cpu::preempt_enable_anywhere();
+    return p;
+} // cpu_heap::pop()
+
+void cpu_heap::push(void* p, unsigned int cls, unsigned int batch) {
+    cpu::preempt_disable();
+    free_list& list = lists[cls];
+    *static_cast<void**>(p) = list.head;
+    list.head = p;
+    if (++list.count >= 2 * batch) {
+        drain(list, cls, batch);
+    }
+    cpu::preempt_enable_anywhere();
+} // cpu_heap::push()
+
+/*
+ * MODIFIES: list, the class's depot
+ *
+ * fills the empty list with a batch from the depot, or carved from the depot's chunk;
+ * returns false if no memory could be mapped
+ */
+bool cpu_heap::refill(free_list& list, unsigned int cls, size_t size, unsigned int batch) {
+    assert(list.head == nullptr && size * batch <= CHUNK_SIZE);
+    depot& d = depots[cls];
+
+    while (d.busy.exchange(true, std::memory_order_acquire)) {
+        cpu_relax();
+    }
+    if (d.batches) {
+        list.head = d.batches;
+        list.count = batch;
+        d.batches = static_cast<void**>(d.batches)[1];
+        d.busy.store(false, std::memory_order_release);
+        return true;
+    }
+
+    // the rest of a chunk too small for a batch is given up; mapping a chunk can take several
+    // system calls, which other cpus would spin through with preemption disabled, so the flag
+    // is let go meanwhile
+    char* spare = nullptr;
+    if (d.chunk_left < size * batch) {
+        d.busy.store(false, std::memory_order_release);
+        char* fresh = map_chunk();
+        if (!fresh) {
+            return false;
+        }
+        while (d.busy.exchange(true, std::memory_order_acquire)) {
+            cpu_relax();
+        }
+
+        // another cpu may have installed a chunk meanwhile; an arena chunk cannot be unmapped
+        // on its own, so it replaces that one
+        if (d.chunk_left >= size * batch && !huge_pages) {
+            spare = fresh;
+        } else {
+            d.chunk = fresh;
+            d.chunk_left = CHUNK_SIZE;
+        }
+    }
+    char* first = d.chunk;
+    d.chunk += size * batch;
+    d.chunk_left -= size * batch;
+    d.busy.store(false, std::memory_order_release);
+
+    if (spare) {
+        munmap(spare, CHUNK_SIZE);
+    }
+
+    for (unsigned int i = 0; i + 1 < batch; ++i) {
+        *reinterpret_cast<void**>(first + i * size) = first + (i + 1) * size;
+    }
+    *reinterpret_cast<void**>(first + (batch - 1) * size) = nullptr;
+    list.head = first;
+    list.count = batch;
+    return true;
+} // cpu_heap::refill()
+
+/*
+ * MODIFIES: list, the class's depot
+ *
+ * hands the first batch of the list to the depot
+ */
+void cpu_heap::drain(free_list& list, unsigned int cls, unsigned int batch) {
+    void* first = list.head;
+    void* last = first;
+    for (unsigned int i = 1; i < batch; ++i) {
+        last = *static_cast<void**>(last);
+    }
+    list.head = *static_cast<void**>(last);
+    list.count -= batch;
+    *static_cast<void**>(last) = nullptr;
+
+    // stacks going cold in the depot give their pages back, but for the first one, which
+    // holds the links
+    if (cls == STACK_CLASS && !huge_pages) {
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        for (char* stk = static_cast<char*>(first); stk; stk = *reinterpret_cast<char**>(stk)) {
+            madvise(stk + page, STACK_SIZE - page, MADV_DONTNEED);
+        }
+    }
+
+    depot& d = depots[cls];
+    while (d.busy.exchange(true, std::memory_order_acquire)) {
+        cpu_relax();
+    }
+    static_cast<void**>(first)[1] = d.batches;
+    d.batches = first;
+    d.busy.store(false, std::memory_order_release);
+} // cpu_heap::drain()
+
+cpu_heap::Backing cpu_heap::backing() {
+    return huge.backing.load(std::memory_order_relaxed);
+} // cpu_heap::backing()
+
+/*
+ * INVARIANT:
+ *              called with preemption disabled and no depot's spin flag held
+ *
+ * returns a fresh CHUNK_SIZE chunk, from the huge-page arena if huge_pages is set, or
+ * nullptr if no memory could be mapped
+ */
+char* cpu_heap::map_chunk() {
+    if (!huge_pages) {
+        void* fresh = mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return fresh == MAP_FAILED ? nullptr : static_cast<char*>(fresh);
+    }
+
+    while (huge.busy.exchange(true, std::memory_order_acquire)) {
+        cpu_relax();
+    }
+    if (huge.left < CHUNK_SIZE) {
+        char* region = map_region();
+        if (!region) {
+            huge.busy.store(false, std::memory_order_release);
+            return nullptr;
+        }
+        huge.next = region;
+        huge.left = ARENA_SIZE;
+    }
+    char* chunk = huge.next;
+    huge.next += CHUNK_SIZE;
+    huge.left -= CHUNK_SIZE;
+    huge.busy.store(false, std::memory_order_release);
+    return chunk;
+} // cpu_heap::map_chunk()
+
+/*
+ * INVARIANT:
+ *              called with the arena's spin flag held
+ *
+ * maps an ARENA_SIZE region aligned to HUGE_PAGE_SIZE, trying hugetlbfs pages, then
+ * transparent huge pages, then ordinary pages; returns nullptr if nothing could be mapped
+ */
+char* cpu_heap::map_region() {
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    // hugetlbfs mappings are aligned to their page size; failing one means the reserve is
+    // exhausted, which it stays
+    if (!huge.no_hugetlb) {
+        void* region = mmap(nullptr, ARENA_SIZE, prot, flags | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            huge.backing.store(Backing::HUGETLB, std::memory_order_relaxed);
+            return static_cast<char*>(region);
+        }
+        huge.no_hugetlb = true;
+    }
+
+    // over-map by one huge page and trim both ends to align the region
+    void* raw = mmap(nullptr, ARENA_SIZE + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+    if (raw == MAP_FAILED) {
+        return nullptr;
+    }
+    char* start = static_cast<char*>(raw);
+    char* region = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(start) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (region != start) {
+        munmap(start, region - start);
+    }
+    munmap(region + ARENA_SIZE, start + HUGE_PAGE_SIZE - region);
+
+    bool thp = madvise(region, ARENA_SIZE, MADV_HUGEPAGE) == 0;
+    huge.backing.store(thp ? Backing::THP : Backing::PAGES, std::memory_order_relaxed);
+    return region;
+} // cpu_heap::map_region()
@@ -0,0 +1,125 @@
+/*
+ * cpu_heap.h -- per-cpu caches of small blocks and thread stacks
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * cpu_heap: an allocator sharded by simulated cpu rather than by host thread
+ *
+ * Blocks of up to MAX_SIZE bytes are rounded up to one of NUM_CLASSES size classes: 16-byte
+ * steps up to 128 bytes, then two classes per power of two up to 4 KiB. Stacks are one more
+ * class. Each cpu keeps a free list per class, linked through the blocks' first word, and
+ * works on it with preemption disabled, so the running thread cannot move to another cpu
+ * halfway; there is no lock and no atomic read-modify-write on this path.
+ *
+ * A cpu whose list runs dry takes a batch of BATCH blocks (STACK_BATCH stacks) from the
+ * class's global depot, or carves a new batch out of a CHUNK_SIZE chunk of fresh memory. A
+ * cpu whose list grows to two batches hands one back to the depot. Memory thus flows from
+ * the cpus that free more than they allocate, such as those reclaiming finished threads, to
+ * those that allocate. Depot batches are chained through their first block's second word,
+ * and a depot's spin flag is only held for a few instructions, with preemption disabled;
+ * chunks are mapped without it. With huge_pages set, the arena's spin flag is held while a
+ * region is mapped, but only cpus that need a fresh chunk wait on it.
+ *
+ * Larger blocks come from the host heap. Blocks are freed with the size they were allocated
+ * with. Memory is never unmapped, but stacks handed to the depot drop their pages unless
+ * huge_pages is set.
+ *
+ * The per-cpu lists are thread-local to the host thread running the cpu; other host threads
+ * that allocate, such as the one that calls cpu::boot(), get lists of their own. Safe with
+ * the cpu guard held; a preemption that falls due during a call made there waits for the
+ * next tick, while one made from user code takes it on the way out, as preempt_enable() does.
+ */
+class cpu_heap {
+public:
+    static constexpr size_t MAX_SIZE = 4096;
+    static constexpr size_t BLOCK_ALIGN = 16;
+    static constexpr unsigned int NUM_CLASSES = 18;
+    static constexpr unsigned int BATCH = 32;
+    static constexpr unsigned int STACK_BATCH = 4;
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+    static constexpr size_t HUGE_PAGE_SIZE = size_t{2} << 20;
+    static constexpr size_t ARENA_SIZE = 16 * HUGE_PAGE_SIZE;
+
+    /*
+     * Huge-page arena, configured before cpu::boot()
+     *
+     * Stacks and TCBs spread over many 4 KiB pages cost a dTLB miss or more on most context
+     * switches. If huge_pages is set, chunks are carved out of ARENA_SIZE regions aligned to
+     * HUGE_PAGE_SIZE, so one TLB entry covers eight stacks. A region is backed by hugetlbfs
+     * pages if the system has enough reserved, otherwise by transparent huge pages, otherwise
+     * by ordinary pages; backing() reports which the latest region got. A huge page is
+     * committed whole, so each stack then costs STACK_SIZE bytes rather than the pages it
+     * touched, and stacks in the depot keep their pages, since dropping part of a huge page
+     * would split or fail on it. For the same reason cpu::stack_reclaim does nothing then.
+     */
+    enum class Backing : uint8_t {NONE = 0, HUGETLB, THP, PAGES};
+
+    inline static bool huge_pages = false;
+    static Backing backing();
+
+    static void* alloc(size_t bytes);
+    static void free(void* p, size_t bytes);
+
+    static char* alloc_stack();                 // a STACK_SIZE stack
+    static void free_stack(char* stk);
+
+    // allocator for std::allocate_shared and containers
+    template <typename T>
+    struct allocator {
+        static_assert(alignof(T) <= BLOCK_ALIGN, "cpu_heap blocks are 16-byte aligned");
+        using value_type = T;
+
+        allocator() = default;
+        template <typename U>
+        allocator(const allocator<U>&) {}
+
+        T* allocate(size_t n) { return static_cast<T*>(cpu_heap::alloc(n * sizeof(T))); }
+        void deallocate(T* p, size_t n) { cpu_heap::free(p, n * sizeof(T)); }
+
+        template <typename U>
+        bool operator==(const allocator<U>&) const { return true; }
+    };
+
+private:
+    static constexpr unsigned int STACK_CLASS = NUM_CLASSES;
+
+    struct free_list {
+        void* head = nullptr;
+        unsigned int count = 0;
+    };
+
+    struct depot {
+        std::atomic<bool> busy{false};
+        void* batches = nullptr;    // full batches, chained through their first block
+        char* chunk = nullptr;      // unused tail of the current chunk
+        size_t chunk_left = 0;
+    };
+
+    struct arena {
+        std::atomic<bool> busy{false};
+        char* next = nullptr;       // unused tail of the current region
+        size_t left = 0;
+        std::atomic<Backing> backing{Backing::NONE};
+        bool no_hugetlb = false;    // a hugetlbfs mapping failed, so none is reserved
+    };
+
+    static unsigned int class_of(size_t bytes);
+    static size_t size_of(unsigned int cls);
+
+    static void* pop(unsigned int cls, size_t size, unsigned int batch);
+    static void push(void* p, unsigned int cls, unsigned int batch);
+    static bool refill(free_list& list, unsigned int cls, size_t size, unsigned int batch);
+    static void drain(free_list& list, unsigned int cls, unsigned int batch);
+    static char* map_chunk();
+    static char* map_region();
+
+    static thread_local free_list lists[NUM_CLASSES + 1];   // this cpu's
+    static depot depots[NUM_CLASSES + 1];
+    static arena huge;
+};
@@ -3,6 +3,7 @@
 #include "cv.h"
 #include <cassert>
 #include "cpu.h"
+#include "parking_lot.h"
 
 
 void cv::wait(mutex& mtx) {
@@ -10,16 +11,18 @@ void cv::wait(mutex& mtx) {
 
     assert_interrupts_disabled();
     assert(cpu::guard == true);
+    cpu* self = cpu::current();
 
-    // printf("\t\t\t\t(CV WAIT): cpu<%d> thread<%d> beginning wait\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
+    // printf("\t\t\t\t(CV WAIT): cpu<%d> thread<%d> beginning wait\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
     // // first 3 steps are atomic
-    if (mtx.thread_holding_lock == static_cast<int>(cpu::self()->curr_thread->id)) {
+    if (mtx.held_by(self->curr_thread->id)) {
         // step 1: release the lock
         mtx.internal_unlock();
         
         // step 2: thread moved to waiting queue
-        cpu::self()->curr_thread->status = Status::BLOCKED;
-        waiting_threads.push(cpu::self()->curr_thread);
+        self->curr_thread->set_status(Status::BLOCKED);
+        num_waiting.fetch_add(1);
+        parking_lot::park(this, self->curr_thread);
     
         // step 3: go to sleep (AKA get the next thread)
         cpu::get_next_thread();
@@ -36,12 +39,12 @@ void cv::signal() {
     
     assert_interrupts_disabled();
     assert(cpu::guard == true);
-    // printf("\t\t\t\t(CV SIGNAL): cpu<%d> thread<%d> signaling a sleeping thread\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-    if (!waiting_threads.empty()) {
-        auto next_thread = waiting_threads.front();
-        waiting_threads.pop();
+    // printf("\t\t\t\t(CV SIGNAL): cpu<%d> thread<%d> signaling a sleeping thread\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+    if (num_waiting.load() != 0) {
+        num_waiting.fetch_sub(1);
+        auto next_thread = parking_lot::unpark(this);
 
-        cpu::push_to_queue(next_thread);
+        cpu::wake_thread(next_thread);
     }
 } // cv::signal()
 
@@ -50,10 +53,9 @@ void cv::broadcast() {
 
     assert_interrupts_disabled();
     assert(cpu::guard == true);
-    // printf("\t\t\t\t(CV SIGNAL): cpu<%d> thread<%d> broadcasting all sleeping threads\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-    while (!waiting_threads.empty()) {
-        auto next_thread = waiting_threads.front();
-        waiting_threads.pop();
+    // printf("\t\t\t\t(CV SIGNAL): cpu<%d> thread<%d> broadcasting all sleeping threads\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+    for (; num_waiting.load() != 0; num_waiting.fetch_sub(1)) {
+        auto next_thread = parking_lot::unpark(this);
         cpu::push_to_queue(next_thread);
     }
 } // cv::broadcast()
\ No newline at end of file
@@ -4,8 +4,8 @@
 
 #pragma once
 
-#include <memory>
-#include <queue>
+#include <atomic>
+#include <cstdint>
 
 #include "cpu.h"
 #include "mutex.h"
@@ -34,5 +34,5 @@ public:
     cv(cv&&);
     cv& operator=(cv&&);
 private:
-    std::queue<std::shared_ptr<TCB>> waiting_threads;
+    std::atomic<uint32_t> num_waiting{0}; // threads in the parking_lot under this cv; changed with the cpu guard held
 };
@@ -0,0 +1,171 @@
+// WORKING code for the deadlock_detector class
+
+#include "deadlock_detector.h"
+
+#ifdef DEADLOCK_DETECT
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cpu.h"
+
+/***************************************************************************************************
+ *                                        Deadlock Detector                                        *
+ ***************************************************************************************************/
+
+namespace {
+
+enum class Wait : uint8_t {MUTEX, JOIN};
+
+struct wait_edge {
+    Wait kind;
+    const void* lock;   // MUTEX: lock being waited for
+    uint32_t target;    // JOIN: thread being joined
+};
+
+// every structure below is only touched with the cpu guard held
+std::unordered_map<uint32_t, wait_edge> waits;          // blocked thread -> what it waits for
+std::unordered_map<const void*, uint32_t> owners;       // held lock -> holding thread
+std::unordered_map<const void*, const char*> names;
+std::set<std::vector<uint32_t>> reported;               // cycles already reported, as rotated to start at the lowest id
+std::atomic<uint64_t> last_check_ns{0};                 // read without the guard by due()
+
+/*
+ * sets 'next' to the thread 'tid' is waiting for and returns true,
+ * or returns false if 'tid' is not blocked on a mutex or a join
+ */
+bool waits_for(uint32_t tid, uint32_t& next) {
+    auto w = waits.find(tid);
+    if (w == waits.end()) {
+        return false;
+    }
+    if (w->second.kind == Wait::JOIN) {
+        next = w->second.target;
+        return true;
+    }
+    auto owner = owners.find(w->second.lock);
+    if (owner == owners.end()) {
+        return false;
+    }
+    next = owner->second;
+    return true;
+}
+
+std::string describe(const void* lock) {
+    char buf[64];
+    auto n = names.find(lock);
+    if (n != names.end()) {
+        return std::string("mutex '") + n->second + "'";
+    }
+    std::snprintf(buf, sizeof(buf), "mutex %p", lock);
+    return buf;
+}
+
+void report(const std::vector<uint32_t>& cycle) {
+    std::fprintf(stderr, "DEADLOCK: cycle of %zu threads\n", cycle.size());
+    for (size_t i = 0; i < cycle.size(); ++i) {
+        uint32_t tid = cycle[i];
+        uint32_t next = cycle[(i + 1) % cycle.size()];
+        const wait_edge& w = waits.at(tid);
+        if (w.kind == Wait::JOIN) {
+            std::fprintf(stderr, "    thread %u joins thread %u\n", tid, next);
+        } else {
+            std::fprintf(stderr, "    thread %u waits for %s held by thread %u\n", tid, describe(w.lock).c_str(), next);
+        }
+    }
+}
+
+} // namespace
+
+void deadlock_detector::name(const void* lock, const char* name) {
+    kernel_guard kg;
+    names[lock] = name;
+} // deadlock_detector::name()
+
+void deadlock_detector::wait_mutex(uint32_t tid, const void* lock) {
+    assert(cpu::guard == true);
+    waits[tid] = wait_edge{Wait::MUTEX, lock, 0};
+} // deadlock_detector::wait_mutex()
+
+void deadlock_detector::wait_thread(uint32_t tid, uint32_t target) {
+    assert(cpu::guard == true);
+    waits[tid] = wait_edge{Wait::JOIN, nullptr, target};
+} // deadlock_detector::wait_thread()
+
+void deadlock_detector::clear_wait(uint32_t tid) {
+    assert(cpu::guard == true);
+    waits.erase(tid);
+} // deadlock_detector::clear_wait()
+
+void deadlock_detector::acquired(const void* lock, uint32_t tid) {
+    assert(cpu::guard == true);
+    owners[lock] = tid;
+    waits.erase(tid);
+} // deadlock_detector::acquired()
+
+void deadlock_detector::released(const void* lock) {
+    assert(cpu::guard == true);
+    owners.erase(lock);
+} // deadlock_detector::released()
+
+bool deadlock_detector::due(uint64_t now) {
+    return now - last_check_ns.load(std::memory_order_relaxed) >= CHECK_NS;
+} // deadlock_detector::due()
+
+void deadlock_detector::tick() {
+    // timer interrupts that arrive while interrupts are disabled are lost, so checks are paced by the clock
+    uint64_t now = cpu::clock_ns();
+    if (due(now)) {
+        last_check_ns.store(now, std::memory_order_relaxed);
+        check();
+    }
+} // deadlock_detector::tick()
+
+/*
+ * Every blocked thread has at most one outgoing edge, so following the edges from a
+ * thread either ends at a running thread or enters a cycle. Threads are colored as
+ * they are visited so every edge is followed once per check.
+ */
+void deadlock_detector::check() {
+    assert(cpu::guard == true);
+
+    std::unordered_map<uint32_t, uint32_t> visited; // thread -> walk that first reached it
+    uint32_t walk = 0;
+
+    for (const auto& [start, edge] : waits) {
+        (void) edge;
+        if (visited.count(start)) {
+            continue;
+        }
+        ++walk;
+
+        std::vector<uint32_t> path;
+        uint32_t tid = start;
+        uint32_t next;
+        while (!visited.count(tid)) {
+            visited[tid] = walk;
+            path.push_back(tid);
+            if (!waits_for(tid, next)) {
+                break;
+            }
+            tid = next;
+        }
+
+        // the walk closed on itself: the cycle is the tail of the path starting at 'tid'
+        if (visited[tid] == walk && waits_for(path.back(), next) && next == tid) {
+            std::vector<uint32_t> cycle(std::find(path.begin(), path.end(), tid), path.end());
+            std::rotate(cycle.begin(), std::min_element(cycle.begin(), cycle.end()), cycle.end());
+            if (reported.insert(cycle).second) {
+                report(cycle);
+            }
+        }
+    }
+} // deadlock_detector::check()
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * deadlock_detector.h -- wait-for graph and cycle detection for mutexes and joins
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/*
+ * deadlock_detector: maintains a wait-for graph between threads and reports cycles
+ *
+ * A thread blocked in mutex::lock() waits for the thread holding the mutex; a thread
+ * blocked in thread::join() waits for the thread being joined, and one blocked in
+ * thread_group::join_all() for the group's oldest unfinished thread. Every blocked thread
+ * waits for at most one other thread, so a deadlock is a cycle of these edges.
+ *
+ * The graph is checked when the last cpu goes idle, and from the timer interrupt
+ * handler at most every CHECK_NS. Each cycle found is reported once on stderr as the
+ * thread ids and lock names along the cycle. Locks can be given names with
+ * deadlock_detector::name().
+ *
+ * The detector is compiled in with -DDEADLOCK_DETECT. Otherwise every hook below is an
+ * empty inline function and the graph is not maintained at all.
+ *
+ * All hooks are called by the thread library with the cpu guard held.
+ */
+#ifdef DEADLOCK_DETECT
+
+class deadlock_detector {
+public:
+    static void name(const void* lock, const char* name);       // name used for 'lock' in reports
+
+    static void wait_mutex(uint32_t tid, const void* lock);     // 'tid' blocked on 'lock'
+    static void wait_thread(uint32_t tid, uint32_t target);     // 'tid' blocked joining 'target'
+    static void clear_wait(uint32_t tid);                       // 'tid' is no longer blocked
+
+    static void acquired(const void* lock, uint32_t tid);       // 'tid' now holds 'lock'
+    static void released(const void* lock);                     // 'lock' is free
+
+    static bool due(uint64_t now);                              // a tick at 'now' would check; needs no guard
+    static void tick();                                         // called from the timer interrupt handler
+    static void check();                                        // report any new cycles
+
+    static constexpr uint64_t CHECK_NS = 1'000'000'000;
+};
+
+#else
+
+class deadlock_detector {
+public:
+    static void name(const void*, const char*) {}
+
+    static void wait_mutex(uint32_t, const void*) {}
+    static void wait_thread(uint32_t, uint32_t) {}
+    static void clear_wait(uint32_t) {}
+
+    static void acquired(const void*, uint32_t) {}
+    static void released(const void*) {}
+
+    static bool due(uint64_t) { return false; }
+    static void tick() {}
+    static void check() {}
+};
+
+#endif
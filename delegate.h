@@ -0,0 +1,176 @@
+/*
+ * delegate.h -- delegation lock: critical sections shipped to a server thread
+ */
+
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "cpu.h"
+#include "thread.h"
+
+/*
+ * delegate<T>: owns a T and a server thread that runs every operation on it
+ *
+ * Instead of moving a lock and the data it protects between cpus, execute(op) ships op to
+ * the server thread, which is the only thread that ever touches the T. The server pins
+ * itself (thread::pin()) to the cpu it first runs on, so the T stays in that cpu's cache
+ * and callers on other cpus wake it there. A request lives on
+ * the caller's stack and is pushed onto a lock-free multi-producer list; the server takes
+ * the whole list at once and runs it in arrival order, then completes the batch and wakes
+ * the callers in a single guard section.
+ *
+ * Callers block the way mutex::lock() does: BLOCKED, parked in the request, and woken with
+ * cpu::wake_thread(). The server blocks the same way when the list is empty, and the first
+ * caller to find it parked wakes it. The server runs ahead of its cpu's runnext, and a caller
+ * woken there goes into the runnext slot, so a caller on the server's cpu and the server
+ * hand the cpu straight back and forth.
+ *
+ * A delegate is constructed and destroyed by a thread (it creates and joins its server).
+ * Ops must not block or call execute() on the same delegate. An exception thrown by an op
+ * is rethrown from the execute() that submitted it.
+ */
+template <typename T>
+class delegate {
+public:
+    template <typename... Args>
+    explicit delegate(Args&&... args)
+        : data(std::forward<Args>(args)...), server(serve, reinterpret_cast<uintptr_t>(this)) {}
+
+    // the server drains every request already submitted before it stops
+    ~delegate() {
+        execute([this](T&) { stopping = true; });
+        server.join();
+    }
+
+    delegate(const delegate&) = delete;
+    delegate& operator=(const delegate&) = delete;
+
+    /*
+     * runs op(T&) on the server thread and returns its result
+     */
+    template <typename Op>
+    std::invoke_result_t<Op&, T&> execute(Op&& op) {
+        using result_t = std::invoke_result_t<Op&, T&>;
+
+        if constexpr (std::is_void_v<result_t>) {
+            request req(&run_op<Op>, &op);
+            submit(req);
+        } else {
+            std::optional<result_t> result;
+            std::pair<Op*, std::optional<result_t>*> call{&op, &result};
+            request req(&run_op_for_result<Op, result_t>, &call);
+            submit(req);
+            return std::move(*result);
+        }
+    }
+
+private:
+    // fields other than run, call and next are only touched with the cpu guard held
+    struct request {
+        request(void (*run)(void*, T&), void* call) : run(run), call(call) {}
+
+        void (*run)(void* call, T& data);
+        void* call;
+        request* next = nullptr;
+        std::exception_ptr error;
+        std::shared_ptr<TCB> waiter;    // the caller, once blocked
+        bool done = false;
+    };
+
+    template <typename Op>
+    static void run_op(void* call, T& data) {
+        (*static_cast<std::remove_reference_t<Op>*>(call))(data);
+    }
+
+    template <typename Op, typename R>
+    static void run_op_for_result(void* call, T& data) {
+        auto* c = static_cast<std::pair<std::remove_reference_t<Op>*, std::optional<R>*>*>(call);
+        c->second->emplace((*c->first)(data));
+    }
+
+    /*
+     * The request is published before the guard is taken, and the server only parks after
+     * finding the list empty with the guard held: either it sees the request, or this
+     * caller sees it parked and wakes it
+     */
+    void submit(request& req) {
+        req.next = pending.load();
+        while (!pending.compare_exchange_weak(req.next, &req)) {}
+
+        {
+            kernel_guard kg;
+            if (parked_server) {
+                auto s = std::move(parked_server);
+                cpu::wake_thread(s);
+            }
+            if (!req.done) {
+                cpu* self = cpu::current();
+                self->curr_thread->set_status(Status::BLOCKED);
+                req.waiter = self->curr_thread;
+                cpu::get_next_thread();
+            }
+        }
+
+        if (req.error) {
+            std::rethrow_exception(req.error);
+        }
+    }
+
+    static void serve(uintptr_t arg) {
+        auto* d = reinterpret_cast<delegate*>(arg);
+        thread::pin();
+
+        while (true) {
+            // requests were pushed LIFO; reverse them to serve in arrival order
+            request* list = d->pending.exchange(nullptr);
+            request* batch = nullptr;
+            while (list) {
+                request* next = list->next;
+                list->next = batch;
+                batch = list;
+                list = next;
+            }
+
+            for (request* r = batch; r; r = r->next) {
+                try {
+                    r->run(r->call, d->data);
+                } catch (...) {
+                    r->error = std::current_exception();
+                }
+            }
+
+            kernel_guard kg;
+            while (batch) {
+                request* r = batch;
+                batch = r->next; // 'r' may be gone once its caller runs again
+                r->done = true;
+                if (r->waiter) {
+                    auto waiter = std::move(r->waiter);
+                    cpu::wake_thread(waiter);
+                }
+            }
+
+            if (d->stopping) {
+                return;
+            }
+            if (d->pending.load() == nullptr) {
+                cpu* self = cpu::current();
+                self->curr_thread->set_status(Status::BLOCKED);
+                d->parked_server = self->curr_thread;
+                cpu::get_next_thread();
+            }
+        }
+    }
+
+    T data;
+    alignas(64) std::atomic<request*> pending{nullptr};    // submitted requests, newest first
+    std::shared_ptr<TCB> parked_server;                     // the server, while blocked on an empty list
+    bool stopping = false;                                  // set by the destructor's request, on the server
+    thread server;
+};
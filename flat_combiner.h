@@ -0,0 +1,190 @@
+/*
+ * flat_combiner.h -- flat-combining executor for contended shared structures
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "cpu.h"
+
+/*
+ * flat_combiner<T>: serializes operations on a T by batching them on one thread
+ *
+ * apply(op) publishes a record for op on the caller's stack, pushing it onto a lock-free
+ * list. Whichever caller takes the combiner flag becomes the combiner: it takes the whole
+ * list at once and runs every pending op against the T, in arrival order, while the T's
+ * cache lines stay in its cpu's cache. It keeps combining until the list stays empty after
+ * it drops the flag, so every published record is served.
+ *
+ * The other callers spin for SPIN_LIMIT rounds, watching for their record to complete or
+ * for the flag to come free. After that they block on the scheduler, and the combiner
+ * wakes them with cpu::wake_thread() when their op is done. A record moves PENDING ->
+ * PARKING -> DONE, or straight from PENDING to DONE. The combiner only takes the cpu guard
+ * for records whose owner started to park.
+ *
+ * Ops run on the combiner's thread and must not block or call apply() on the same combiner.
+ * An exception thrown by an op is rethrown from the apply() that submitted it.
+ */
+template <typename T>
+class flat_combiner {
+public:
+    template <typename... Args>
+    explicit flat_combiner(Args&&... args) : data(std::forward<Args>(args)...) {}
+
+    flat_combiner(const flat_combiner&) = delete;
+    flat_combiner& operator=(const flat_combiner&) = delete;
+
+    /*
+     * runs op(T&) as part of some thread's batch and returns its result
+     */
+    template <typename Op>
+    std::invoke_result_t<Op&, T&> apply(Op&& op) {
+        using result_t = std::invoke_result_t<Op&, T&>;
+
+        if constexpr (std::is_void_v<result_t>) {
+            record rec(&run_op<Op>, &op);
+            submit(rec);
+        } else {
+            std::optional<result_t> result;
+            std::pair<Op*, std::optional<result_t>*> call{&op, &result};
+            record rec(&run_op_for_result<Op, result_t>, &call);
+            submit(rec);
+            return std::move(*result);
+        }
+    }
+
+    static constexpr unsigned int SPIN_LIMIT = 256;
+
+private:
+    enum : uint8_t {PENDING = 0, PARKING, DONE};
+
+    struct record {
+        record(void (*run)(void*, T&), void* call) : run(run), call(call) {}
+
+        void (*run)(void* call, T& data);
+        void* call;
+        record* next = nullptr;
+        std::exception_ptr error;
+        std::shared_ptr<TCB> parked;        // the owner, once blocked; only touched with the cpu guard held
+        std::atomic<uint8_t> state{PENDING};
+    };
+
+    template <typename Op>
+    static void run_op(void* call, T& data) {
+        (*static_cast<std::remove_reference_t<Op>*>(call))(data);
+    }
+
+    template <typename Op, typename R>
+    static void run_op_for_result(void* call, T& data) {
+        auto* c = static_cast<std::pair<std::remove_reference_t<Op>*, std::optional<R>*>*>(call);
+        c->second->emplace((*c->first)(data));
+    }
+
+    /*
+     * returns once 'rec' is DONE, having run it as the combiner or waited for one
+     */
+    void submit(record& rec) {
+        rec.next = pending.load();
+        while (!pending.compare_exchange_weak(rec.next, &rec)) {}
+
+        for (unsigned int spins = 0; rec.state.load() != DONE; ++spins) {
+            if (try_combine()) {
+                continue;
+            }
+            if (spins >= SPIN_LIMIT) {
+                park(rec);
+                continue;
+            }
+            cpu_relax();
+        }
+
+        if (rec.error) {
+            std::rethrow_exception(rec.error);
+        }
+    }
+
+    /*
+     * Dropping the flag and then checking the list pairs with publishing a record and then
+     * checking the flag: either the combiner sees the record, or its owner sees the flag free
+     */
+    bool try_combine() {
+        if (combining.load() || combining.exchange(true)) {
+            return false;
+        }
+        do {
+            while (pending.load() != nullptr) {
+                combine();
+            }
+            combining.store(false);
+        } while (pending.load() != nullptr && !combining.exchange(true));
+        return true;
+    }
+
+    void combine() {
+        // records were pushed LIFO; reverse them to serve in arrival order
+        record* list = pending.exchange(nullptr);
+        record* ordered = nullptr;
+        while (list) {
+            record* next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+
+        while (ordered) {
+            record* r = ordered;
+            ordered = r->next; // 'r' may be gone as soon as it is completed
+            try {
+                r->run(r->call, data);
+            } catch (...) {
+                r->error = std::current_exception();
+            }
+            complete(*r);
+        }
+    }
+
+    /*
+     * The owner returns as soon as it sees DONE, so 'rec' is not touched after DONE is
+     * stored. An owner that got to PARKING cannot return before it holds the guard, so
+     * that store happens with the guard held: the owner then either blocked already and
+     * is woken here, or has yet to take the guard and will find DONE.
+     */
+    void complete(record& rec) {
+        uint8_t expected = PENDING;
+        if (rec.state.compare_exchange_strong(expected, DONE)) {
+            return;
+        }
+        kernel_guard kg;
+        auto owner = std::move(rec.parked);
+        rec.state.store(DONE);
+        if (owner) {
+            cpu::wake_thread(owner);
+        }
+    }
+
+    void park(record& rec) {
+        uint8_t expected = PENDING;
+        if (!rec.state.compare_exchange_strong(expected, PARKING)) {
+            return; // already DONE
+        }
+
+        kernel_guard kg;
+        if (rec.state.load() == PARKING) {
+            cpu* self = cpu::current();
+            self->curr_thread->set_status(Status::BLOCKED);
+            rec.parked = self->curr_thread;
+            cpu::get_next_thread();
+        }
+    }
+
+    T data;
+    alignas(64) std::atomic<record*> pending{nullptr};  // published records, newest first
+    alignas(64) std::atomic<bool> combining{false};     // held by the combiner
+};
@@ -0,0 +1,109 @@
+/*
+ * histogram.h -- log-bucketed latency histogram
+ */
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * histogram: HDR-style histogram of nanosecond values
+ *
+ * Values below 2^SUB_BITS get a bucket each. Every larger power of two [2^e, 2^(e+1)) is
+ * split into 2^SUB_BITS linear sub-buckets, so a bucket's bounds are within 1/2^SUB_BITS
+ * (12.5%) of any value it holds, across the whole 64-bit range.
+ *
+ * Counters are relaxed atomics: record() never takes a lock, and histograms can be read
+ * and merged while other cpus keep recording into them.
+ */
+class histogram {
+public:
+    static constexpr unsigned int SUB_BITS = 3;
+    static constexpr unsigned int SUB_BUCKETS = 1u << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    histogram() = default;
+
+    histogram(const histogram&) = delete;
+    histogram& operator=(const histogram&) = delete;
+
+    void record(uint64_t value) {
+        counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // adds every count in 'other' to this histogram
+    void merge(const histogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts[i].fetch_add(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    void reset() {
+        for (auto& c : counts) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (const auto& c : counts) {
+            total += c.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /*
+     * returns the upper bound of the bucket holding the p-th quantile (0 < p <= 1),
+     * or 0 if the histogram is empty
+     */
+    uint64_t percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(total) + 0.999999);
+        if (rank == 0) {
+            rank = 1;
+        }
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return upper_bound(i);
+            }
+        }
+        return upper_bound(BUCKETS - 1);
+    }
+
+    uint64_t bucket_count(size_t i) const { return counts[i].load(std::memory_order_relaxed); }
+
+    static size_t index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        unsigned int e = static_cast<unsigned int>(std::bit_width(value)) - 1;
+        uint64_t sub = (value >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (e - SUB_BITS + 1) * SUB_BUCKETS + static_cast<size_t>(sub);
+    }
+
+    static uint64_t lower_bound(size_t i) {
+        if (i < SUB_BUCKETS) {
+            return i;
+        }
+        unsigned int e = static_cast<unsigned int>(i / SUB_BUCKETS) + SUB_BITS - 1;
+        uint64_t sub = i % SUB_BUCKETS;
+        return (uint64_t{1} << e) | (sub << (e - SUB_BITS));
+    }
+
+    static uint64_t upper_bound(size_t i) {
+        return i + 1 == BUCKETS ? UINT64_MAX : lower_bound(i + 1) - 1;
+    }
+
+private:
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+};
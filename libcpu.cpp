@@ -0,0 +1,352 @@
+// WORKING code for the simulated cpu infrastructure (replaces libcpu.o)
+
+#include <atomic>
+#include <cassert>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <linux/futex.h>
+#include <memory>
+#include <new>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+/***************************************************************************************************
+ *                                          Infrastructure                                         *
+ ***************************************************************************************************/
+
+/*
+ * Each simulated cpu is a host thread. Interrupts are signals sent to that thread: the timer
+ * is a POSIX timer delivering timer_signal() every TICK_NS to the thread itself, and an IPI is
+ * a flag in the target's cpu_state, followed by a futex wake if the target is suspended or
+ * by ipi_signal() if it is running.
+ *
+ * Interrupt masking is virtual: the signals are never blocked, and disabling interrupts is a
+ * store to the thread-local interrupts_on. A signal that arrives while interrupts are off only
+ * marks the interrupt pending, and interrupt_enable() raises it after turning interrupts back
+ * on. The kernel sections of the thread library are short and frequent, so this saves two
+ * sigprocmask system calls per section.
+ *
+ * A cpu's cpu object lives at the start of its cpu_state, so interrupt_send() finds the
+ * target's state without a lookup, and cpu::self() is a thread_local read.
+ */
+
+std::atomic<bool> cpu::guard{false};
+
+namespace {
+
+constexpr long TICK_NS = 1'000'000;
+constexpr unsigned int SYNC_INTERRUPT_ODDS = 8; // sync mode: one interrupt per this many interrupt_enable() calls, on average
+
+struct cpu_state {
+    alignas(cpu) unsigned char storage[sizeof(cpu)];    // the cpu object; must stay first
+    pid_t host_tid = 0;
+    timer_t timer{};
+    unsigned int seed = 0;                              // sync mode interrupt pattern
+    std::atomic<uint32_t> ipi_pending{0};               // futex word
+    std::atomic<bool> suspended{false};                 // in interrupt_enable_suspend(), not yet woken
+};
+
+static_assert(std::is_standard_layout<cpu_state>::value);
+
+std::unique_ptr<cpu_state[]> states;
+unsigned int total_cpus = 0;
+bool async_ticks = false;
+bool sync_ticks = false;
+std::atomic<unsigned int> num_suspended{0};
+
+/*
+ * Read and written by this host thread and by its signal handlers, which can run between
+ * any two instructions: volatile keeps every access a single load or store in program order
+ */
+thread_local cpu_state* self_state = nullptr;
+thread_local volatile bool interrupts_on = false;
+thread_local volatile bool timer_pending = false;
+thread_local volatile bool ipi_signalled = false;  // the IPI itself is ipi_pending in cpu_state
+
+int timer_signal() { return SIGRTMIN; }
+int ipi_signal() { return SIGRTMIN + 1; }
+
+sigset_t interrupt_signals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, timer_signal());
+    sigaddset(&set, ipi_signal());
+    return set;
+}
+
+cpu_state* state_of(cpu* c) {
+    return reinterpret_cast<cpu_state*>(c);
+}
+
+void futex_wait(std::atomic<uint32_t>* word, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+// calls an interrupt handler the way the hardware would: with interrupts enabled
+void raise_interrupt(unsigned int vector) {
+    cpu::self()->interrupt_vector_table[vector]();
+}
+
+/*
+ * Handlers are installed with SA_NODEFER and an empty mask, so interrupts stay enabled
+ * inside them until the thread library's handler disables them. A handler may switch to
+ * another thread's context; the signal frame is returned through whenever this context
+ * is resumed.
+ */
+void on_timer_signal(int) {
+    if (self_state->suspended.load()) {
+        return; // the cpu ignores timer interrupts while suspended
+    }
+    if (!interrupts_on) {
+        timer_pending = true;
+        return;
+    }
+    raise_interrupt(cpu::TIMER);
+}
+
+void on_ipi_signal(int) {
+    if (!interrupts_on) {
+        ipi_signalled = true;
+        return;
+    }
+    if (self_state->ipi_pending.exchange(0) != 0) { // otherwise already handled, when the cpu was woken from suspend
+        raise_interrupt(cpu::IPI);
+    }
+}
+
+/*
+ * the process ends once every cpu is suspended and no IPI is on its way to wake one;
+ * a cpu sending an IPI is not suspended, and takes its target out of num_suspended
+ * before suspending itself
+ */
+void exit_if_all_suspended() {
+    if (num_suspended.load() != total_cpus) {
+        return;
+    }
+    for (unsigned int i = 0; i < total_cpus; ++i) {
+        if (states[i].ipi_pending.load() != 0) {
+            return;
+        }
+    }
+    std::fflush(nullptr);
+    std::fputs("All CPUs suspended.  Exiting.\n", stdout);
+    std::fflush(stdout);
+    _exit(0);
+}
+
+void start_timer(cpu_state* s) {
+    sigevent ev{};
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = timer_signal();
+    ev._sigev_un._tid = s->host_tid;
+    if (timer_create(CLOCK_MONOTONIC, &ev, &s->timer) != 0) {
+        std::perror("timer_create");
+        std::abort();
+    }
+
+    itimerspec spec{};
+    spec.it_interval.tv_nsec = TICK_NS;
+    spec.it_value.tv_nsec = TICK_NS;
+    timer_settime(s->timer, 0, &spec, nullptr);
+}
+
+struct cpu_start {
+    cpu_state* state;
+    thread_startfunc_t func;
+    uintptr_t arg;
+};
+
+/*
+ * runs on the cpu's host thread, which starts with interrupts disabled; the cpu
+ * constructor never returns
+ */
+void* run_cpu(void* p) {
+    cpu_start start = *static_cast<cpu_start*>(p);
+    delete static_cast<cpu_start*>(p);
+
+    self_state = start.state;
+    self_state->host_tid = static_cast<pid_t>(syscall(SYS_gettid));
+    if (async_ticks) {
+        start_timer(self_state);
+    }
+
+    new (self_state->storage) cpu(start.func, start.arg);
+
+    std::fprintf(stderr, "cpu::cpu() returned to the infrastructure\n");
+    std::abort();
+}
+
+} // namespace
+
+void cpu::boot(unsigned int num_cpus, thread_startfunc_t func, uintptr_t arg,
+               bool async, bool sync, unsigned int random_seed) {
+    if (states) {
+        throw std::runtime_error("cpu::boot() called more than once");
+    }
+    if (num_cpus == 0) {
+        throw std::runtime_error("cpu::boot() needs at least one cpu");
+    }
+
+    total_cpus = num_cpus;
+    async_ticks = async;
+    sync_ticks = sync;
+    states = std::make_unique<cpu_state[]>(num_cpus);
+
+    struct sigaction sa{};
+    sa.sa_flags = SA_NODEFER | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = on_timer_signal;
+    sigaction(timer_signal(), &sa, nullptr);
+    sa.sa_handler = on_ipi_signal;
+    sigaction(ipi_signal(), &sa, nullptr);
+
+    // every cpu starts with interrupts disabled; the signals themselves are never blocked
+    sigset_t set = interrupt_signals();
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    interrupts_on = false;
+
+    for (unsigned int i = 0; i < num_cpus; ++i) {
+        states[i].seed = random_seed + i;
+    }
+
+    for (unsigned int i = 1; i < num_cpus; ++i) {
+        pthread_t host;
+        auto start = new cpu_start{&states[i], nullptr, 0};
+        if (pthread_create(&host, nullptr, run_cpu, start) != 0) {
+            throw std::runtime_error("cpu::boot() could not create a host thread");
+        }
+        pthread_detach(host);
+    }
+
+    // the booting thread becomes cpu 0, which runs func(arg)
+    run_cpu(new cpu_start{&states[0], func, arg});
+} // cpu::boot()
+
+cpu* cpu::self() {
+    return reinterpret_cast<cpu*>(self_state);
+} // cpu::self()
+
+void cpu::interrupt_disable() {
+    interrupts_on = false;
+} // cpu::interrupt_disable()
+
+/*
+ * Interrupts that arrived while disabled are raised here, after interrupts are back on,
+ * exactly as if they had just arrived. A handler may switch this context to another cpu,
+ * so the thread-local flags are re-read after each one.
+ */
+void cpu::interrupt_enable() {
+    interrupts_on = true;
+
+    if (ipi_signalled) {
+        ipi_signalled = false;
+        if (self_state->ipi_pending.exchange(0) != 0) {
+            raise_interrupt(cpu::IPI);
+        }
+    }
+
+    if (timer_pending) {
+        timer_pending = false;
+        raise_interrupt(cpu::TIMER);
+    }
+
+    // sync mode: a repeatable pseudo-random pattern of timer interrupts at enable points
+    if (sync_ticks && rand_r(&self_state->seed) % SYNC_INTERRUPT_ODDS == 0) {
+        raise_interrupt(cpu::TIMER);
+    }
+} // cpu::interrupt_enable()
+
+/*
+ * Sleeps on the cpu's ipi_pending futex word with interrupts still disabled, which makes
+ * enabling and suspending atomic: an IPI sent at any point after the call is seen either
+ * by the check below or by the futex wait, which signals only interrupt early. Returns
+ * once the IPI handler returns.
+ */
+void cpu::interrupt_enable_suspend() {
+    assert_interrupts_disabled();
+    cpu_state* s = self_state;
+
+    s->suspended.store(true);
+    num_suspended.fetch_add(1);
+    timer_pending = false;
+
+    while (s->ipi_pending.load() == 0) {
+        exit_if_all_suspended();
+        futex_wait(&s->ipi_pending, 0);
+    }
+
+    // the sender normally takes the cpu out of suspension; an IPI that arrived before the
+    // cpu was marked suspended is picked up here instead
+    if (s->suspended.exchange(false)) {
+        num_suspended.fetch_sub(1);
+    }
+    s->ipi_pending.store(0);
+    ipi_signalled = false;
+
+    cpu::interrupt_enable();
+    raise_interrupt(cpu::IPI);
+} // cpu::interrupt_enable_suspend()
+
+void cpu::interrupt_send() {
+    cpu_state* target = state_of(this);
+
+    target->ipi_pending.store(1);
+    if (target->suspended.exchange(false)) {
+        num_suspended.fetch_sub(1);
+        futex_wake(&target->ipi_pending);
+    } else {
+        syscall(SYS_tgkill, getpid(), target->host_tid, ipi_signal());
+    }
+} // cpu::interrupt_send()
+
+void assert_interrupts_private(bool disabled, std::source_location loc) {
+    if (interrupts_on == disabled) {
+        std::fprintf(stderr, "%s:%u: %s: interrupts should be %s\n",
+                     loc.file_name(), loc.line(), loc.function_name(), disabled ? "disabled" : "enabled");
+        std::abort();
+    }
+} // assert_interrupts_private()
+
+/*
+ * Unlike ::makecontext(), 'ucp' need not come from getcontext() and arguments are passed as
+ * full uintptr_t values. Interrupts are disabled whenever the thread library switches
+ * contexts, so a new context starts with them disabled without masking anything.
+ */
+void makecontext(ucontext_t* ucp, char* stack, unsigned int stack_size, void (*func)(), int argc, ...) {
+    static constexpr int MAX_ARGS = 4;
+    if (argc < 0 || argc > MAX_ARGS) {
+        throw std::runtime_error("makecontext() supports at most 4 arguments");
+    }
+
+    uintptr_t args[MAX_ARGS] = {};
+    va_list ap;
+    va_start(ap, argc);
+    for (int i = 0; i < argc; ++i) {
+        args[i] = va_arg(ap, uintptr_t);
+    }
+    va_end(ap);
+
+    getcontext(ucp);
+    ucp->uc_stack.ss_sp = stack;
+    ucp->uc_stack.ss_size = stack_size;
+    ucp->uc_stack.ss_flags = 0;
+    ucp->uc_link = nullptr;
+    sigset_t set = interrupt_signals();
+    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    pthread_sigmask(SIG_SETMASK, nullptr, &ucp->uc_sigmask);
+
+    // on x86-64 glibc passes each of these through a full 64-bit register
+    ::makecontext(ucp, func, argc, args[0], args[1], args[2], args[3]);
+} // makecontext()
@@ -4,13 +4,16 @@
 #include <stdexcept>
 
 #include "cpu.h"
+#include "deadlock_detector.h"
 #include "mutex.h"
+#include "parking_lot.h"
+#include "sched_stats.h"
 
 /***************************************************************************************************
  *                                              Mutex                                              *
  ***************************************************************************************************/
 
-mutex::mutex() : thread_holding_lock(-1), free(true)
+mutex::mutex() : state(0)
 {} // mutex::mutex()
 
 /*
@@ -18,29 +21,38 @@ mutex::mutex() : thread_holding_lock(-1), free(true)
  *
  * interrupts are disabled; can be used by the OS in cv::wait()
  *
- * modifies thread_holding_lock
+ * modifies state
  */
 void mutex::internal_lock() {
     assert_interrupts_disabled();
     assert(cpu::guard == true);
+    cpu* self = cpu::current();
 
-    assert(cpu::self()->curr_thread && "Current thread calling lock is not null");
+    assert(self->curr_thread && "Current thread calling lock is not null");
 
-    if (!free) {
+    uint32_t s = state.load();
+    if (s != 0) {
         // Confirm that the current thread has not finished s.o.e
-        assert(cpu::self()->curr_thread->status != Status::FINISHED || cpu::self()->curr_thread->status != Status::READY);
+        assert(self->curr_thread->status != Status::FINISHED || self->curr_thread->status != Status::READY);
         
-        // printf("\t\t\t\t(MUTEX LOCK): cpu <%d> thread<%d> did not acquire mutex; pushed to waiting queue\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
+        // printf("\t\t\t\t(MUTEX LOCK): cpu <%d> thread<%d> did not acquire mutex; pushed to waiting queue\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
         
-        cpu::self()->curr_thread->status = Status::BLOCKED;
-        assert(cpu::self()->curr_thread->status == Status::BLOCKED);
-        waiting_threads.push(cpu::self()->curr_thread);
+        self->curr_thread->set_status(Status::BLOCKED);
+        assert(self->curr_thread->status == Status::BLOCKED);
+        state.store(s | PARKED);
+        parking_lot::park(this, self->curr_thread);
+        deadlock_detector::wait_mutex(self->curr_thread->id, this);
 
+        uint64_t wait_start = cpu::clock_ns();
         cpu::get_next_thread();
+
+        // the unlocking thread handed the lock over before waking this one
+        sched_stats::record(sched_stats::LOCK_WAIT, cpu::clock_ns() - wait_start);
     } else {
-        thread_holding_lock = static_cast<int>(cpu::self()->curr_thread->id); // review
-        free = false;
-        // printf("\t\t\t\t(MUTEX LOCK): <cpu %d> Lock was acquired by thread <%d>\n", cpu::self()->cpu_id, thread_holding_lock);
+        assert(self->curr_thread->id + 1 < PARKED);
+        state.store(self->curr_thread->id + 1);
+        deadlock_detector::acquired(this, self->curr_thread->id);
+        // printf("\t\t\t\t(MUTEX LOCK): <cpu %d> Lock was acquired by thread <%d>\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
     }
 } // mutex::internal_lock();
 
@@ -49,32 +61,34 @@ void mutex::internal_lock() {
  *
  * interrupts are disabled; can be used by the OS in cv::wait()
  *
- * modifies thread_holding_lock
+ * modifies state
  */
 void mutex::internal_unlock() {
     assert_interrupts_disabled();
     assert(cpu::guard == true);
+    cpu* self = cpu::current();
 
-    if (thread_holding_lock != static_cast<int>(cpu::self()->curr_thread->id)) {
+    if (!held_by(self->curr_thread->id)) {
         throw std::runtime_error("Unlock called by thread not holding mutex\n");
     }
 
-    assert(cpu::self()->curr_thread && "Current thread calling lock is not null");
-    free = true;
+    assert(self->curr_thread && "Current thread calling lock is not null");
+    deadlock_detector::released(this);
 
-    if (!waiting_threads.empty()) {
-        auto waiting_thread = waiting_threads.front();
-        waiting_threads.pop();
+    if (state.load() & PARKED) {
+        auto waiting_thread = parking_lot::unpark(this);
 
-        // printf("\t\t\t\t(MUTEX UNLOCK) <cpu %d thread %d> thread being popped from mutex waiting queue\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-        assert(waiting_thread->status != Status::FINISHED);
+        // printf("\t\t\t\t(MUTEX UNLOCK) <cpu %d thread %d> thread being popped from mutex waiting queue\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
         assert(waiting_thread.get() != nullptr && "Waiting thread after unlock is null");
+        assert(waiting_thread->status != Status::FINISHED);
         
-        thread_holding_lock = static_cast<int>(waiting_thread->id);
-        free = false;
+        state.store((waiting_thread->id + 1) | (parking_lot::has_waiters(this) ? PARKED : 0));
+        deadlock_detector::acquired(this, waiting_thread->id);
         
-        // printf("\t\t\t\t(MUTEX UNLOCK): <cpu %d thread %d> thread<%d> popped from waiting queue and pushed onto ready queue after waiting for a lock\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id, waiting_thread->id);
-        cpu::push_to_queue(waiting_thread);
+        // printf("\t\t\t\t(MUTEX UNLOCK): <cpu %d thread %d> thread<%d> popped from waiting queue and pushed onto ready queue after waiting for a lock\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id, waiting_thread->id);
+        cpu::wake_thread(waiting_thread);
+    } else {
+        state.store(0);
     }
 } // mutex::internal_unlock()
 
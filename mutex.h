@@ -4,8 +4,8 @@
 
 #pragma once
 
-#include <memory>
-#include <queue>
+#include <atomic>
+#include <cstdint>
 
 #include "cpu.h"
 
@@ -36,9 +36,13 @@ private:
     void internal_lock();
     void internal_unlock();
 
-    // Queue of waiting threads, pointer to thread holding lock and the mutexes status
-    std::queue<std::shared_ptr<TCB>> waiting_threads;
+    bool held_by(uint32_t tid) const { return (state.load() & ~PARKED) == tid + 1; }
 
-    int thread_holding_lock; // thread ID thats holding lock
-    bool free;
+    /*
+     * 0 while free; otherwise the holder's thread id + 1, with PARKED set while threads are
+     * waiting for the mutex in the parking_lot. Only changed with the cpu guard held.
+     */
+    std::atomic<uint32_t> state;
+
+    static constexpr uint32_t PARKED = 1u << 31;
 };
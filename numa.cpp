@@ -0,0 +1,132 @@
+// WORKING code for the numa class
+
+#include <algorithm>
+#include <cassert>
+#include <linux/mempolicy.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "cpu_heap.h"
+#include "numa.h"
+#include "thread.h"
+
+/***************************************************************************************************
+ *                                               NUMA                                              *
+ ***************************************************************************************************/
+
+void numa::set_topology(std::vector<unsigned int> nodes) {
+    if (cpu::booted) {
+        throw std::runtime_error("numa::set_topology() called after cpu::boot()");
+    }
+    cpu_to_node = std::move(nodes);
+    pools.clear();
+    if (!cpu_to_node.empty()) {
+        pools.resize(*std::max_element(cpu_to_node.begin(), cpu_to_node.end()) + 1);
+    }
+} // numa::set_topology()
+
+unsigned int numa::node_of(unsigned int cpu_id) {
+    return enabled() ? cpu_to_node[cpu_id % cpu_to_node.size()] : 0;
+} // numa::node_of()
+
+unsigned int numa::current_node() {
+    return enabled() ? node_of(cpu::current()->cpu_id) : 0;
+} // numa::current_node()
+
+int numa::node_of_memory(const void* p) {
+    int node = -1;
+    *static_cast<const volatile char*>(p); // get_mempolicy() reports nothing for pages not yet faulted in
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+} // numa::node_of_memory()
+
+/*
+ * maps 'bytes' of fresh memory preferring 'node'; pages are placed when first touched, so
+ * the policy has to be set before anything is written to them
+ */
+char* numa::map_on_node(size_t bytes, unsigned int node) {
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+
+    static constexpr unsigned long MAX_NODES = 1024;
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+    if (node < MAX_NODES) {
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        // a node the host does not have is rejected; the memory is still usable, just unbound
+        syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, MAX_NODES, 0);
+    }
+    return static_cast<char*>(p);
+} // numa::map_on_node()
+
+numa::pool& numa::pool_of(unsigned int node) {
+    assert(cpu::guard == true);
+    assert(node < pools.size());
+    return pools[node];
+} // numa::pool_of()
+
+char* numa::alloc_stack(unsigned int node) {
+    if (!enabled()) {
+        return cpu_heap::alloc_stack();
+    }
+
+    pool& p = pool_of(node);
+    if (!p.stacks.empty()) {
+        char* stk = p.stacks.back();
+        p.stacks.pop_back();
+        return stk;
+    }
+    return map_on_node(STACK_SIZE, node);
+} // numa::alloc_stack()
+
+void numa::free_stack(char* stk, unsigned int node) {
+    if (!enabled()) {
+        cpu_heap::free_stack(stk);
+        return;
+    }
+    pool_of(node).stacks.push_back(stk);
+} // numa::free_stack()
+
+void* numa::alloc(unsigned int node, size_t bytes) {
+    if (!enabled()) {
+        return cpu_heap::alloc(bytes);
+    }
+
+    size_t size = (bytes + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    assert(size <= SLAB_SIZE);
+
+    pool& p = pool_of(node);
+    auto& free_list = p.blocks[size];
+    if (!free_list.empty()) {
+        void* block = free_list.back();
+        free_list.pop_back();
+        return block;
+    }
+
+    // the rest of a slab too small for this block is given up
+    if (p.slab_left < size) {
+        p.slab = map_on_node(SLAB_SIZE, node);
+        p.slab_left = SLAB_SIZE;
+    }
+    void* block = p.slab;
+    p.slab += size;
+    p.slab_left -= size;
+    return block;
+} // numa::alloc()
+
+void numa::free(void* block, unsigned int node, size_t bytes) {
+    if (!enabled()) {
+        cpu_heap::free(block, bytes);
+        return;
+    }
+
+    size_t size = (bytes + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    pool_of(node).blocks[size].push_back(block);
+} // numa::free()
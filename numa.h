@@ -0,0 +1,95 @@
+/*
+ * numa.h -- NUMA topology of the simulated cpus and node-local memory pools
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * numa: maps the simulated cpus onto NUMA nodes and keeps a memory pool per node
+ *
+ * The topology is configured before cpu::boot() with set_topology(): cpu i is on node
+ * cpu_to_node[i % cpu_to_node.size()]. Without a topology every cpu is on node 0 and all
+ * memory comes from cpu_heap, as if NUMA support were not there.
+ *
+ * With a topology, a thread is homed on the node of the cpu that created it. Its stack, TCB
+ * and context are carved from that node's pool, whose pages are bound to the node with
+ * mbind(MPOL_PREFERRED). Node ids are host node ids; binding to a node the machine does not
+ * have fails and is ignored, so a two-node topology can be exercised on a single-node
+ * machine, and node_of_memory() shows where pages actually ended up.
+ *
+ * Freed stacks and blocks go on their node's free lists and are reused by the next thread
+ * homed there; pool memory is never returned to the OS.
+ *
+ * cpu::pop_ready() dispatches the first of the next LOOKAHEAD ready threads that is homed on
+ * the dispatching cpu's node, if there is one, so threads mostly run next to their memory
+ * while a cpu never goes idle with work left on the ready queue.
+ *
+ * Pools are only touched with the cpu guard held.
+ */
+class numa {
+public:
+    static void set_topology(std::vector<unsigned int> cpu_to_node);   // configured before cpu::boot()
+    static bool enabled() { return !cpu_to_node.empty(); }
+
+    static unsigned int node_of(unsigned int cpu_id);
+    static unsigned int current_node();                     // node of the executing cpu
+
+    /*
+     * returns the host node holding the page at 'p' (faulting it in if needed), or -1 if
+     * the kernel does not support NUMA policies
+     */
+    static int node_of_memory(const void* p);
+
+    static char* alloc_stack(unsigned int node);            // a STACK_SIZE stack from 'node's pool
+    static void free_stack(char* stk, unsigned int node);
+
+    static void* alloc(unsigned int node, size_t bytes);    // a block of at most SLAB_SIZE bytes from 'node's pool
+    static void free(void* p, unsigned int node, size_t bytes);
+
+    // deleter for stacks returned by alloc_stack()
+    struct stack_deleter {
+        unsigned int node = 0;
+        void operator()(char* stk) const { numa::free_stack(stk, node); }
+    };
+
+    // allocator for std::allocate_shared and containers, drawing from one node's pool
+    template <typename T>
+    struct allocator {
+        using value_type = T;
+
+        unsigned int node;
+
+        explicit allocator(unsigned int node) : node(node) {}
+        template <typename U>
+        allocator(const allocator<U>& other) : node(other.node) {}
+
+        T* allocate(size_t n) { return static_cast<T*>(numa::alloc(node, n * sizeof(T))); }
+        void deallocate(T* p, size_t n) { numa::free(p, node, n * sizeof(T)); }
+
+        template <typename U>
+        bool operator==(const allocator<U>& other) const { return node == other.node; }
+    };
+
+    static constexpr size_t LOOKAHEAD = 4;
+    static constexpr size_t SLAB_SIZE = 1 << 20;
+    static constexpr size_t BLOCK_ALIGN = 64;  // blocks never share a cache line
+
+private:
+    struct pool {
+        std::vector<char*> stacks;                              // free stacks
+        std::unordered_map<size_t, std::vector<void*>> blocks;  // free blocks, by rounded size
+        char* slab = nullptr;                                   // unused tail of the current slab
+        size_t slab_left = 0;
+    };
+
+    static char* map_on_node(size_t bytes, unsigned int node);
+    static pool& pool_of(unsigned int node);
+
+    inline static std::vector<unsigned int> cpu_to_node;
+    inline static std::vector<pool> pools;  // indexed by node
+};
@@ -0,0 +1,63 @@
+// WORKING code for the parking_lot class
+
+#include <cassert>
+
+#include "cpu.h"
+#include "parking_lot.h"
+
+/***************************************************************************************************
+ *                                           Parking Lot                                           *
+ ***************************************************************************************************/
+
+std::vector<parking_lot::wait_queue>& parking_lot::bucket_of(const void* addr) {
+    assert(cpu::guard == true);
+    // Fibonacci hashing; the low bits of an object address carry little
+    uint64_t h = (reinterpret_cast<uintptr_t>(addr) >> 4) * 0x9E3779B97F4A7C15ULL;
+    return buckets[h >> (64 - BUCKET_BITS)];
+} // parking_lot::bucket_of()
+
+void parking_lot::park(const void* addr, std::shared_ptr<TCB> thread) {
+    assert(thread && !thread->parked_next);
+    auto& bucket = bucket_of(addr);
+
+    for (auto& q : bucket) {
+        if (q.addr == addr) {
+            TCB* tail = thread.get();
+            q.tail->parked_next = std::move(thread);
+            q.tail = tail;
+            return;
+        }
+    }
+
+    TCB* tail = thread.get();
+    bucket.push_back(wait_queue{addr, std::move(thread), tail});
+} // parking_lot::park()
+
+std::shared_ptr<TCB> parking_lot::unpark(const void* addr) {
+    auto& bucket = bucket_of(addr);
+
+    for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+        if (it->addr != addr) {
+            continue;
+        }
+
+        std::shared_ptr<TCB> thread = std::move(it->head);
+        it->head = std::move(thread->parked_next);
+        if (!it->head) {
+            // the queue goes away with its last waiter
+            *it = std::move(bucket.back());
+            bucket.pop_back();
+        }
+        return thread;
+    }
+    return nullptr;
+} // parking_lot::unpark()
+
+bool parking_lot::has_waiters(const void* addr) {
+    for (auto& q : bucket_of(addr)) {
+        if (q.addr == addr) {
+            return true;
+        }
+    }
+    return false;
+} // parking_lot::has_waiters()
@@ -0,0 +1,46 @@
+/*
+ * parking_lot.h -- wait queues keyed by address, shared by every mutex and cv
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct TCB;
+
+/*
+ * parking_lot: the FIFO wait queues of all mutexes and condition variables
+ *
+ * A mutex or cv keeps only one word of its own state. Threads blocked on it are queued here
+ * under the object's address, in a table of NUM_BUCKETS hashed buckets. A queue exists only
+ * while some thread is waiting on that address: it is a head and a tail, with the waiters
+ * chained through TCB::parked_next, so queueing a thread allocates nothing once the bucket
+ * has held a queue before.
+ *
+ * The lot only keeps the queues; callers set thread status and block or wake threads
+ * themselves. It is only touched with the cpu guard held.
+ */
+class parking_lot {
+public:
+    static void park(const void* addr, std::shared_ptr<TCB> thread);   // appends 'thread' to addr's queue
+    static std::shared_ptr<TCB> unpark(const void* addr);              // removes addr's oldest waiter; null if none
+    static bool has_waiters(const void* addr);
+
+    static constexpr unsigned int BUCKET_BITS = 8;
+    static constexpr size_t NUM_BUCKETS = size_t{1} << BUCKET_BITS;
+
+private:
+    struct wait_queue {
+        const void* addr;
+        std::shared_ptr<TCB> head;
+        TCB* tail;
+    };
+
+    // few addresses share a bucket, so a bucket is searched linearly
+    static std::vector<wait_queue>& bucket_of(const void* addr);
+
+    inline static std::vector<wait_queue> buckets[NUM_BUCKETS];
+};
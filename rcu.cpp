@@ -0,0 +1,149 @@
+// WORKING code for the rcu class
+
+#include <algorithm>
+#include <cassert>
+
+#include "cpu.h"
+#include "rcu.h"
+
+/***************************************************************************************************
+ *                                                RCU                                              *
+ ***************************************************************************************************/
+
+/*
+ * A grace period already under way may have started before the caller's update, so the
+ * caller needs the one after it
+ */
+uint64_t rcu::request_gp() {
+    assert(cpu::guard == true);
+    if (gp_started != gp_completed) {
+        return gp_started + 1;
+    }
+    start_gp();
+    return gp_started;
+} // rcu::request_gp()
+
+void rcu::start_gp() {
+    ++gp_started;
+    cpus_left = 0;
+
+    for (cpu* c : cpu::cpus) {
+        if (c->curr_thread && c->curr_thread != c->suspended_thread) {
+            c->rcu_qs_needed.store(true, std::memory_order_relaxed);
+            ++cpus_left;
+        }
+    }
+    // printf("\t\t\t\t(RCU): grace period %lu started, waiting for %u cpus\n", gp_started, cpus_left);
+
+    if (cpus_left == 0) {
+        end_gp();
+    }
+} // rcu::start_gp()
+
+void rcu::end_gp() {
+    gp_completed = gp_started;
+
+    auto done = std::partition(waiters.begin(), waiters.end(), [](const waiter& w) { return w.gp > gp_completed; });
+    for (auto it = done; it != waiters.end(); ++it) {
+        cpu::push_to_queue(it->thread);
+    }
+    waiters.erase(done, waiters.end());
+
+    bool more_ready = false;
+    while (!pending.empty() && pending.front().gp <= gp_completed) {
+        ready.push_back(pending.front());
+        pending.pop_front();
+        more_ready = true;
+    }
+
+    // wake an idle cpu to run the callbacks
+    if (more_ready) {
+        cpu::fetch_cpu();
+    }
+
+    if (!waiters.empty() || !pending.empty()) {
+        start_gp();
+    }
+} // rcu::end_gp()
+
+void rcu::quiescent(cpu* c) {
+    assert(cpu::guard == true);
+    if (c->rcu_qs_needed.load(std::memory_order_relaxed)) {
+        c->rcu_qs_needed.store(false, std::memory_order_relaxed);
+        if (--cpus_left == 0) {
+            end_gp();
+        }
+    }
+} // rcu::quiescent()
+
+void rcu::synchronize() {
+    kernel_guard kg;
+    cpu* self = cpu::current();
+    assert(cpu::preempt_count == 0 && "rcu::synchronize() called inside a read section");
+
+    uint64_t gp = request_gp();
+
+    // The caller is not in a read section, so this cpu is in a quiescent state now and can
+    // report it here. The caller can return once grace period 'gp' has completed. Until
+    // then, each pass starts the next grace period if none is running. If that grace
+    // period waits for this cpu, the pass reports this cpu's quiescent state, which may end
+    // it. Once the running grace period waits only for other cpus, the caller blocks below
+    // and end_gp() readies it when 'gp' completes.
+    while (gp > gp_completed) {
+        if (gp_started == gp_completed) {
+            start_gp();
+        }
+        if (!self->rcu_qs_needed.load(std::memory_order_relaxed)) {
+            break;
+        }
+        rcu::quiescent(self);
+    }
+    if (gp <= gp_completed) {
+        return;
+    }
+
+    waiters.push_back(waiter{gp, self->curr_thread});
+    self->curr_thread->set_status(Status::BLOCKED);
+    cpu::get_next_thread();
+} // rcu::synchronize()
+
+void rcu::call(rcu_callback_t func, uintptr_t arg) {
+    std::vector<callback> batch;
+    {
+        kernel_guard kg;
+        pending.push_back(callback{request_gp(), func, arg});
+        if (ready.size() >= CALLBACK_BACKLOG) {
+            batch.swap(ready);
+        }
+    }
+
+    if (batch.empty()) {
+        return;
+    }
+
+    // run the backlog the way an idle cpu would: without the guard, with interrupts disabled
+    cpu::interrupt_disable();
+    for (const auto& cb : batch) {
+        cb.func(cb.arg);
+    }
+    cpu::interrupt_enable();
+} // rcu::call()
+
+bool rcu::run_callbacks() {
+    assert_interrupts_disabled();
+    assert(cpu::guard == true);
+
+    if (ready.empty()) {
+        return false;
+    }
+    std::vector<callback> batch;
+    batch.swap(ready);
+
+    cpu::guard_release();
+    for (const auto& cb : batch) {
+        cb.func(cb.arg);
+    }
+    batch.clear();
+    cpu::guard_acquire();
+    return true;
+} // rcu::run_callbacks()
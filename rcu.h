@@ -0,0 +1,96 @@
+/*
+ * rcu.h -- read-copy-update with context switches as quiescent states
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+
+using rcu_callback_t = void (*)(uintptr_t);
+
+/*
+ * rcu: lock-free readers for read-mostly data, with writers waiting out the readers
+ *
+ * A reader brackets its accesses with read_lock() and read_unlock(), which only disable
+ * preemption (cpu::preempt_disable()), and loads shared pointers with dereference(). A
+ * writer publishes a new version with assign(), then either waits in synchronize() until
+ * no reader can still hold the old one, or hands it to call() to be freed later.
+ *
+ * A reader cannot block, yield or be preempted, so once a cpu has dispatched a thread, gone
+ * idle, or taken a timer interrupt outside a read section, none of the readers it was
+ * running are left: that is a quiescent state. A grace period starts by marking every busy
+ * cpu (cpu::rcu_qs_needed) and ends once each of them has passed a quiescent state. Idle
+ * cpus hold no readers and are not waited for.
+ *
+ * synchronize() blocks the writer until a grace period that started after the call has
+ * ended. Callbacks passed to call() are run once such a grace period has ended, in batches,
+ * by cpus about to go idle. If more than CALLBACK_BACKLOG callbacks are waiting for an idle
+ * cpu, the next call() runs them itself. Either way they run without the cpu guard, with
+ * interrupts disabled, and must not call into the thread library.
+ *
+ * Grace period state is only touched with the cpu guard held.
+ */
+class rcu {
+public:
+    static void read_lock() { cpu::preempt_disable(); }
+    static void read_unlock() { cpu::preempt_enable(); }
+
+    template <typename T>
+    static T* dereference(const std::atomic<T*>& p) { return p.load(std::memory_order_acquire); }
+
+    template <typename T>
+    static void assign(std::atomic<T*>& p, T* v) { p.store(v, std::memory_order_release); }
+
+    static void synchronize();                          // waits for a full grace period
+    static void call(rcu_callback_t func, uintptr_t arg); // runs func(arg) after a full grace period
+
+    /*
+     * INVARIANT:
+     *              called with the cpu guard held
+     *
+     * reports a quiescent state of cpu 'c'
+     */
+    static void quiescent(cpu* c);
+
+    /*
+     * INVARIANT:
+     *              called by a cpu about to go idle, with the cpu guard held
+     *
+     * runs the callbacks whose grace period has ended, letting go of the guard meanwhile;
+     * returns whether there were any
+     */
+    static bool run_callbacks();
+
+    static constexpr size_t CALLBACK_BACKLOG = 1024;
+
+private:
+    struct callback {
+        uint64_t gp;        // grace period that must end first
+        rcu_callback_t func;
+        uintptr_t arg;
+    };
+
+    struct waiter {
+        uint64_t gp;
+        std::shared_ptr<TCB> thread;
+    };
+
+    static uint64_t request_gp();   // returns the first grace period that starts after now
+    static void start_gp();
+    static void end_gp();
+
+    inline static uint64_t gp_started = 0;
+    inline static uint64_t gp_completed = 0;
+    inline static unsigned int cpus_left = 0;       // cpus still to pass a quiescent state in the current grace period
+
+    inline static std::vector<waiter> waiters;      // threads blocked in synchronize()
+    inline static std::deque<callback> pending;     // in grace period order
+    inline static std::vector<callback> ready;      // grace period over; run by idle cpus
+};
@@ -0,0 +1,101 @@
+// WORKING code for the sched_log class
+
+#include <cassert>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "cpu.h"
+#include "sched_log.h"
+
+/***************************************************************************************************
+ *                                          Scheduling Log                                         *
+ ***************************************************************************************************/
+
+namespace {
+
+uint64_t preempt_key(uint32_t tid, uint32_t sync_ops) {
+    return (static_cast<uint64_t>(tid) << 32) | sync_ops;
+}
+
+} // namespace
+
+void sched_log::record_to(const char* path) {
+    assert(!cpu::booted && "the scheduling log mode must be chosen before cpu::boot()");
+
+    out = std::fopen(path, "wb");
+    if (!out) {
+        throw std::runtime_error("sched_log: could not open recording for writing\n");
+    }
+
+    const uint32_t header[2] = {MAGIC, VERSION};
+    std::fwrite(header, sizeof(header), 1, out);
+
+    buffer.reserve(BUFFER_RECORDS);
+    mode = Mode::RECORD;
+
+    // cpu::suspend_helper() flushes once every cpu is idle; this covers runs that call exit()
+    std::atexit(sched_log::flush);
+} // sched_log::record_to()
+
+void sched_log::replay_from(const char* path) {
+    assert(!cpu::booted && "the scheduling log mode must be chosen before cpu::boot()");
+
+    FILE* in = std::fopen(path, "rb");
+    if (!in) {
+        throw std::runtime_error("sched_log: could not open recording for reading\n");
+    }
+
+    uint32_t header[2] = {0, 0};
+    if (std::fread(header, sizeof(header), 1, in) != 1 || header[0] != MAGIC || header[1] != VERSION) {
+        std::fclose(in);
+        throw std::runtime_error("sched_log: not a scheduling log recording\n");
+    }
+
+    record r;
+    while (std::fread(&r, sizeof(r), 1, in) == 1) {
+        if (r.event == Event::DISPATCH) {
+            dispatch_order.push_back(r.tid);
+        } else if (r.event == Event::PREEMPT) {
+            preemptions.insert(preempt_key(r.tid, r.arg));
+        }
+    }
+    std::fclose(in);
+
+    mode = Mode::REPLAY;
+} // sched_log::replay_from()
+
+void sched_log::log(Event event, unsigned int cpu_id, uint32_t tid, uint32_t arg) {
+    if (mode != Mode::RECORD) {
+        return;
+    }
+
+    buffer.push_back(record{tid, arg, static_cast<uint16_t>(cpu_id), event, 0});
+    if (buffer.size() == BUFFER_RECORDS) {
+        flush();
+    }
+} // sched_log::log()
+
+bool sched_log::next_dispatch(uint32_t& tid) {
+    assert(mode == Mode::REPLAY);
+
+    if (dispatch_pos == dispatch_order.size()) {
+        return false;
+    }
+    tid = dispatch_order[dispatch_pos++];
+    return true;
+} // sched_log::next_dispatch()
+
+bool sched_log::preempt_recorded(uint32_t tid, uint32_t sync_ops) {
+    assert(mode == Mode::REPLAY);
+    return preemptions.erase(preempt_key(tid, sync_ops)) != 0;
+} // sched_log::preempt_recorded()
+
+void sched_log::flush() {
+    if (!out || buffer.empty()) {
+        return;
+    }
+
+    std::fwrite(buffer.data(), sizeof(record), buffer.size(), out);
+    std::fflush(out);
+    buffer.clear();
+} // sched_log::flush()
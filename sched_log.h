@@ -0,0 +1,105 @@
+/*
+ * sched_log.h -- record and replay of scheduling decisions
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * sched_log: records every scheduling decision made by the thread library and
+ * replays a recording by forcing the same decisions on a later run
+ *
+ * A preemption point is identified by the number of library calls (kernel_guard entries)
+ * the preempted thread had made when the timer fired. Between two library calls a thread
+ * of a data-race-free program only touches state no other thread can observe, so
+ * preempting it just before its next library call is equivalent to where the timer hit.
+ *
+ * RECORD: every dispatch (which thread was taken off the ready queue, a runnext slot or a
+ *         pinned queue by which cpu),
+ *         every IPI sent through cpu::fetch_cpu() and every timer preemption is appended
+ *         to an in-memory buffer and written out in fixed-size binary records.
+ *         Appending happens with the cpu guard held, so recording costs a store into
+ *         the buffer per decision and a write() per BUFFER_RECORDS decisions.
+ *
+ * REPLAY: timer interrupts no longer preempt; kernel_guard preempts a thread at the library
+ *         call where it was preempted in the recording, and cpu::pop_ready() dispatches the
+ *         threads in the recorded order, wherever they wait. If the run diverges (the
+ *         recorded thread is not ready), the usual order is followed and the divergence is
+ *         counted.
+ *
+ *         On one cpu this reproduces the recorded run exactly. With several cpus the order
+ *         of dispatches and preemptions is reproduced, but not the relative speed of
+ *         threads running at the same time on different cpus.
+ *
+ * The mode must be chosen before cpu::boot() is called.
+ */
+class sched_log {
+public:
+    enum class Mode : uint8_t {OFF = 0, RECORD, REPLAY};
+    enum class Event : uint8_t {DISPATCH = 0, IPI, PREEMPT};
+
+    /*
+     * On-disk record. 'arg' depends on the event:
+     *
+     * DISPATCH: number of library calls 'tid' had made when it was dispatched
+     * IPI:      id of the cpu sending the IPI ('cpu' is the cpu being woken)
+     * PREEMPT:  number of library calls 'tid' had made when it was preempted
+     */
+    struct record {
+        uint32_t tid;
+        uint32_t arg;
+        uint16_t cpu;
+        Event event;
+        uint8_t reserved;
+    };
+    static_assert(sizeof(record) == 12);
+
+    static void record_to(const char* path);    // start recording to 'path'
+    static void replay_from(const char* path);  // replay the recording at 'path'
+
+    /*
+     * INVARIANT:
+     *              called with the cpu guard held
+     *
+     * appends a record when recording, otherwise does nothing
+     */
+    static void log(Event event, unsigned int cpu_id, uint32_t tid, uint32_t arg);
+
+    /*
+     * INVARIANT:
+     *              called with the cpu guard held while replaying
+     *
+     * sets 'tid' to the next thread the recording dispatched and returns true,
+     * or returns false once the recording is exhausted
+     */
+    static bool next_dispatch(uint32_t& tid);
+
+    /*
+     * INVARIANT:
+     *              called with the cpu guard held while replaying
+     *
+     * returns true (once) if thread 'tid' was preempted after making 'sync_ops' library calls
+     */
+    static bool preempt_recorded(uint32_t tid, uint32_t sync_ops);
+
+    static void flush();                        // writes out any buffered records
+
+    inline static Mode mode = Mode::OFF;
+    inline static uint64_t divergences = 0;     // dispatches that did not follow the recording
+
+private:
+    static constexpr uint32_t MAGIC = 0x44484353; // "SCHD"
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t BUFFER_RECORDS = 4096;
+
+    inline static FILE* out = nullptr;
+    inline static std::vector<record> buffer;
+
+    inline static std::vector<uint32_t> dispatch_order; // replayed dispatches, in order
+    inline static size_t dispatch_pos = 0;
+    inline static std::unordered_set<uint64_t> preemptions; // (tid << 32) | sync_ops
+};
@@ -0,0 +1,61 @@
+// WORKING code for the sched_stats class
+
+#include <cassert>
+
+#include "cpu.h"
+#include "sched_stats.h"
+
+/***************************************************************************************************
+ *                                         Scheduling Stats                                        *
+ ***************************************************************************************************/
+
+sched_stats::slo sched_stats::slos[NUM_METRICS];
+
+void sched_stats::record(Metric metric, uint64_t ns) {
+    cpu::current()->stats->hist[metric].record(ns);
+} // sched_stats::record()
+
+void sched_stats::merged(Metric metric, histogram& out) {
+    kernel_guard kg;
+    merged_locked(metric, out);
+} // sched_stats::merged()
+
+void sched_stats::merged_locked(Metric metric, histogram& out) {
+    assert(cpu::guard == true);
+
+    for (cpu* c : cpu::cpus) {
+        out.merge(c->stats->hist[metric]);
+    }
+} // sched_stats::merged_locked()
+
+void sched_stats::set_slo(Metric metric, uint64_t bound_ns, slo_callback_t callback) {
+    kernel_guard kg;
+    slos[metric] = slo{bound_ns, callback, false};
+} // sched_stats::set_slo()
+
+void sched_stats::tick() {
+    assert(cpu::guard == true);
+
+    uint64_t now = cpu::clock_ns();
+    if (!due(now)) {
+        return;
+    }
+    last_check_ns.store(now, std::memory_order_relaxed);
+
+    for (unsigned int m = 0; m < NUM_METRICS; ++m) {
+        if (!slos[m].callback) {
+            continue;
+        }
+
+        histogram all;
+        merged_locked(static_cast<Metric>(m), all);
+        uint64_t p99 = all.percentile(0.99);
+
+        if (p99 > slos[m].bound_ns && !slos[m].violated) {
+            slos[m].violated = true;
+            slos[m].callback(static_cast<Metric>(m), p99, slos[m].bound_ns);
+        } else if (p99 <= slos[m].bound_ns) {
+            slos[m].violated = false;
+        }
+    }
+} // sched_stats::tick()
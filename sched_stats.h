@@ -0,0 +1,74 @@
+/*
+ * sched_stats.h -- per-cpu scheduling latency histograms and SLO monitor
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "histogram.h"
+
+/*
+ * sched_stats: one set of latency histograms per cpu
+ *
+ * DISPATCH_LATENCY: time a thread spent on the ready queue before this cpu dispatched it
+ * LOCK_WAIT:        time from blocking in mutex::lock() until running again with the lock held
+ * IPI_LATENCY:      time from cpu::fetch_cpu() sending an IPI until this cpu handled it
+ * TIME_SLICE:       time a thread ran on this cpu before blocking, yielding or finishing
+ *
+ * Each cpu records into its own histograms (cpu::stats), so recording never contends;
+ * merged() combines them across cpus.
+ *
+ * An SLO can be set per metric: on the first timer interrupt after every SLO_CHECK_NS the
+ * merged p99 is compared against the bound and the callback is called when the p99 first
+ * exceeds it. (Timer interrupts that arrive while interrupts are disabled are lost, so the
+ * check is paced by the clock rather than by counting ticks.)
+ * The callback runs inside the timer interrupt handler with the cpu guard held, so it
+ * must not call into the thread library.
+ */
+class sched_stats {
+public:
+    enum Metric : uint8_t {DISPATCH_LATENCY = 0, LOCK_WAIT, IPI_LATENCY, TIME_SLICE, NUM_METRICS};
+
+    using slo_callback_t = void (*)(Metric metric, uint64_t p99_ns, uint64_t bound_ns);
+
+    histogram hist[NUM_METRICS];
+
+    static void record(Metric metric, uint64_t ns);     // records into the executing cpu's histogram
+    static void merged(Metric metric, histogram& out);  // adds every cpu's histogram for 'metric' to 'out'
+
+    /*
+     * calls 'callback' when the p99 of 'metric' across all cpus exceeds 'bound_ns';
+     * a null callback removes the SLO
+     */
+    static void set_slo(Metric metric, uint64_t bound_ns, slo_callback_t callback);
+
+    /*
+     * INVARIANT:
+     *              called from the timer interrupt handler with the cpu guard held
+     */
+    static void tick();
+
+    /*
+     * returns true if a tick at 'now' would check the SLOs; called without the guard, so the
+     * timer interrupt handler takes it only when a check is due
+     */
+    static bool due(uint64_t now) {
+        return now - last_check_ns.load(std::memory_order_relaxed) >= SLO_CHECK_NS;
+    }
+
+    static constexpr uint64_t SLO_CHECK_NS = 100'000'000;
+
+private:
+    static void merged_locked(Metric metric, histogram& out);
+
+    struct slo {
+        uint64_t bound_ns = 0;
+        slo_callback_t callback = nullptr;
+        bool violated = false;  // the callback fires again only after p99 drops below the bound
+    };
+
+    static slo slos[NUM_METRICS];
+    inline static std::atomic<uint64_t> last_check_ns{0};
+};
@@ -0,0 +1,119 @@
+/*
+ * seqlock.h -- sequence lock for small read-mostly records
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <type_traits>
+
+#include "atomic_record.h"
+#include "cpu.h"
+#include "thread.h"
+
+/*
+ * seqlock<T>: lock-free reads of a small, trivially copyable T, such as a timestamp or a
+ * config snapshot
+ *
+ * A reader copies the record without writing anything shared. It retries if a write was
+ * under way or happened meanwhile, which the sequence number tells: odd while a write is in
+ * progress, and 2 higher after each write. The record is an atomic_record, so a torn copy
+ * is only ever thrown away, never undefined.
+ *
+ * Writers serialize on the sequence number itself, taking it from even to odd, and hold it
+ * with preemption disabled (cpu::preempt_disable()). A timer interrupt cannot switch a
+ * writer out halfway through, so readers spin for the length of one write at most, never a
+ * whole quantum. A reader or writer that has spun SPIN_LIMIT rounds anyway (the writer's
+ * cpu may be stalled by the host) yields, unless it is itself in a preempt_disable() section.
+ *
+ * write() runs op(T&) on a copy of the record and publishes the result; op must not block,
+ * yield or call into the thread library. If op throws, the record is left unchanged.
+ */
+template <typename T>
+class seqlock {
+    static_assert(std::is_trivially_copyable_v<T>, "seqlock<T> copies T bytewise");
+
+public:
+    explicit seqlock(const T& init = T()) : record(init) {}
+
+    seqlock(const seqlock&) = delete;
+    seqlock& operator=(const seqlock&) = delete;
+
+    /*
+     * returns a consistent copy of the record
+     */
+    T read() const {
+        for (unsigned int spins = 0;; ++spins) {
+            uint32_t before = seq.load(std::memory_order_acquire);
+            if ((before & 1) == 0) {
+                T copy = record.load();
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq.load(std::memory_order_relaxed) == before) {
+                    return copy;
+                }
+            }
+            backoff(spins);
+        }
+    }
+
+    /*
+     * MODIFIES: the record
+     *
+     * replaces the record with op's changes to a copy of it
+     */
+    template <typename Op>
+    void write(Op&& op) {
+        uint32_t before = lock();
+        T copy = record.load();
+        try {
+            op(copy);
+        } catch (...) {
+            unlock(before);
+            throw;
+        }
+        record.store(copy);
+        unlock(before + 2);
+    }
+
+    void write(const T& value) {
+        write([&value](T& record) { record = value; });
+    }
+
+    static constexpr unsigned int SPIN_LIMIT = 256;
+
+private:
+    static void backoff(unsigned int spins) {
+        if (spins >= SPIN_LIMIT && cpu::preempt_count == 0) {
+            thread::yield();
+        } else {
+            cpu_relax();
+        }
+    }
+
+    // returns the even sequence number the write started from, with preemption disabled
+    uint32_t lock() {
+        for (unsigned int spins = 0;; ++spins) {
+            uint32_t before = seq.load(std::memory_order_relaxed);
+            if ((before & 1) == 0) {
+                cpu::preempt_disable();
+                if (seq.compare_exchange_weak(before, before + 1, std::memory_order_relaxed)) {
+                    // the data stores below must not become visible before the odd number
+                    std::atomic_thread_fence(std::memory_order_release);
+                    return before;
+                }
+                cpu::preempt_enable();
+            }
+            backoff(spins);
+        }
+    }
+
+    void unlock(uint32_t after) {
+        seq.store(after, std::memory_order_release);
+        cpu::preempt_enable();
+    }
+
+    std::atomic<uint32_t> seq{0};
+    atomic_record<T> record;
+};
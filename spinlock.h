@@ -0,0 +1,64 @@
+/*
+ * spinlock.h -- spinlock whose holder cannot be preempted
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "cpu.h"
+#include "thread.h"
+
+/*
+ * spinlock: mutual exclusion for critical sections of a few dozen instructions, where
+ * mutex::lock() and its trip through the cpu guard would cost more than the section
+ *
+ * The holder runs with preemption disabled (cpu::preempt_disable()), so a timer interrupt
+ * cannot switch it out while others spin on the lock; a preemption that comes due meanwhile
+ * happens in unlock(). Waiters spin on a plain load with preemption enabled and only disable
+ * it around the exchange that takes the lock. A waiter that has spun SPIN_LIMIT rounds, for
+ * instance because the host has stalled the holder's cpu, yields between rounds, unless it
+ * is already in a preempt_disable() section such as another spinlock.
+ *
+ * The critical section must not block, yield or call into the thread library. spinlock
+ * meets BasicLockable, so std::lock_guard and std::scoped_lock work with it.
+ */
+class spinlock {
+public:
+    spinlock() = default;
+
+    spinlock(const spinlock&) = delete;
+    spinlock& operator=(const spinlock&) = delete;
+
+    void lock() {
+        unsigned int spins = 0;
+        while (!try_lock()) {
+            while (held.load(std::memory_order_relaxed)) {
+                if (++spins > SPIN_LIMIT && cpu::preempt_count == 0) {
+                    thread::yield();
+                } else {
+                    cpu_relax();
+                }
+            }
+        }
+    }
+
+    bool try_lock() {
+        cpu::preempt_disable();
+        if (!held.exchange(true, std::memory_order_acquire)) {
+            return true;
+        }
+        cpu::preempt_enable();
+        return false;
+    }
+
+    void unlock() {
+        held.store(false, std::memory_order_release);
+        cpu::preempt_enable();
+    }
+
+    static constexpr unsigned int SPIN_LIMIT = 256;
+
+private:
+    std::atomic<bool> held{false};
+};
@@ -0,0 +1,67 @@
+// WORKING code for the stack_watermark class
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+
+#include "cpu.h"
+#include "stack_watermark.h"
+#include "thread.h"
+
+/***************************************************************************************************
+ *                                         Stack Watermark                                         *
+ ***************************************************************************************************/
+
+void stack_watermark::fill(char* stk, size_t size) {
+    for (size_t i = 0; i + sizeof(CANARY) <= size; i += sizeof(CANARY)) {
+        std::memcpy(stk + i, &CANARY, sizeof(CANARY));
+    }
+} // stack_watermark::fill()
+
+/*
+ * Stacks grow down from stk + size, so the untouched canaries are at the low end
+ */
+void stack_watermark::record(thread_startfunc_t func, const char* stk, size_t size) {
+    assert(cpu::guard == true);
+
+    size_t untouched = 0;
+    uint64_t word;
+    while (untouched + sizeof(word) <= size) {
+        std::memcpy(&word, stk + untouched, sizeof(word));
+        if (word != CANARY) {
+            break;
+        }
+        untouched += sizeof(word);
+    }
+
+    usage& u = by_func[func];
+    size_t used = size - untouched;
+    ++u.threads;
+    u.total_bytes += used;
+    if (used > u.max_bytes) {
+        u.max_bytes = used;
+    }
+} // stack_watermark::record()
+
+void stack_watermark::report(FILE* out) {
+    kernel_guard kg;
+
+    std::fprintf(out, "stack usage (of %u bytes per stack):\n", STACK_SIZE);
+    std::fprintf(out, "    %-32s %10s %10s %10s\n", "start function", "threads", "max", "avg");
+    for (const auto& [func, u] : by_func) {
+        char name[32];
+        Dl_info info;
+        if (dladdr(reinterpret_cast<void*>(func), &info) && info.dli_sname) {
+            int status;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            std::snprintf(name, sizeof(name), "%s", status == 0 ? demangled : info.dli_sname);
+            std::free(demangled);
+        } else {
+            std::snprintf(name, sizeof(name), "%p", reinterpret_cast<void*>(func));
+        }
+        std::fprintf(out, "    %-32s %10lu %10zu %10lu\n", name, static_cast<unsigned long>(u.threads), u.max_bytes,
+                     static_cast<unsigned long>(u.total_bytes / u.threads));
+    }
+} // stack_watermark::report()
@@ -0,0 +1,51 @@
+/*
+ * stack_watermark.h -- stack usage high-water-mark measurement
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+
+#include "cpu.h"
+
+/*
+ * stack_watermark: measures how much of each thread's stack was actually used
+ *
+ * When enabled (before cpu::boot()), every new stack is filled with CANARY. When a thread
+ * finishes, thread::thread_execution scans its stack from the far end for the first byte
+ * that was overwritten; everything above it is the thread's high-water mark. Results are
+ * aggregated per start function and printed by report().
+ *
+ * Filling and scanning touch the whole stack, so this is a measurement mode, not
+ * something to leave on in production.
+ */
+class stack_watermark {
+public:
+    inline static bool enabled = false;
+
+    static constexpr uint64_t CANARY = 0xa5a5a5a5a5a5a5a5;
+
+    static void fill(char* stk, size_t size);   // pre-fills a new stack with CANARY
+
+    /*
+     * INVARIANT:
+     *              called with the cpu guard held, by the thread that owns 'stk'
+     *
+     * measures the high-water mark of 'stk' and adds it to func's totals
+     */
+    static void record(thread_startfunc_t func, const char* stk, size_t size);
+
+    static void report(FILE* out);              // prints the per-function totals
+
+private:
+    struct usage {
+        uint64_t threads = 0;
+        size_t max_bytes = 0;
+        uint64_t total_bytes = 0;
+    };
+
+    inline static std::unordered_map<thread_startfunc_t, usage> by_func;
+};
@@ -1,9 +1,15 @@
 // WORKING code for the thread class
 
+#include <bit>
 #include <cassert>
+#include <exception>
 
 #include "cpu.h"
+#include "deadlock_detector.h"
+#include "sched_stats.h"
+#include "stack_watermark.h"
 #include "thread.h"
+#include "thread_group.h"
 
 /***************************************************************************************************
  *                                              Thread                                             *
@@ -16,28 +22,47 @@
     kernel_guard kg;
 
     assert_interrupts_disabled();
-    // printf("\t\t\t\t(THREAD) thread constructor called by cpu<%d> thread<%d>\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-     
-    assert(func != nullptr); // fails if a null pointer is passed into 'func'
-    assert(cpu::self()->booted);
-     
-    auto tcb = std::make_shared<TCB>(); // allocate tcb on heap
- 
-    makecontext(tcb->uc.get(), 
-                tcb->stk.get(), 
-                STACK_SIZE, 
-                reinterpret_cast<void(*)()>(thread::thread_execution), 
-                2, 
-                func, arg);
- 
-    assert(tcb.get() != nullptr);
+    // printf("\t\t\t\t(THREAD) thread constructor called by cpu<%d> thread<%d>\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+
+    auto tcb = thread::create_tcb(func, arg);
 
     this_thread = tcb;
+    tcb->final_times = &final_times;
  
-    // printf("\t\t\t\t(THREAD) thread<%d> created by cpu<%d> thread<%d> and pushed onto ready queue\n", tcb->id, cpu::self()->cpu_id, cpu::self()->curr_thread->id);
+    // printf("\t\t\t\t(THREAD) thread<%d> created by cpu<%d> thread<%d> and pushed onto ready queue\n", tcb->id, cpu::current()->cpu_id, cpu::current()->curr_thread->id);
     cpu::push_to_queue(tcb);
  } // thread::thread()
 
+std::shared_ptr<TCB> thread::create_tcb(thread_startfunc_t func, uintptr_t arg) {
+    assert(cpu::guard == true);
+    assert(func != nullptr); // fails if a null pointer is passed into 'func'
+    assert(cpu::current()->booted);
+
+    auto tcb = TCB::create(); // allocate tcb on the creating cpu's node
+
+    makecontext(tcb->uc.get(),
+                tcb->stk.get(),
+                STACK_SIZE,
+                reinterpret_cast<void(*)()>(thread::thread_execution),
+                2,
+                func, arg);
+
+    assert(tcb.get() != nullptr);
+    return tcb;
+} // thread::create_tcb()
+
+/*
+ * A TCB made by TCB::create() shares its allocation with its control block, which is only
+ * freed with the last weak reference, so this can return the TCB to its node's pool
+ */
+thread::~thread() {
+    kernel_guard kg;
+    if (auto tcb = this_thread.lock()) {
+        tcb->final_times = nullptr;
+    }
+    this_thread.reset();
+} // thread::~thread()
+
 
 /* 
  * thread_execution: Function wrapper for the thread.
@@ -52,45 +77,75 @@
  * looks for the next available thread to run and begins its process
  *
  * otherwise, it will suspend
+ *
+ * Threads spawned by a thread_group notify the group when they finish, and 
+ * exceptions escaping func(arg) are handed to the group instead of propagating
  * 
  */
 void thread::thread_execution(thread_startfunc_t func, uintptr_t arg) {
     assert_interrupts_disabled();
     assert(cpu::guard == true);
 
-    // printf("\t\t\t\t(THREAD EXEC): cpu<%d> starting thread<%d> user code\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
+    thread_group* group = cpu::current()->curr_thread->group;
+    std::exception_ptr error;
+
+    // printf("\t\t\t\t(THREAD EXEC): cpu<%d> starting thread<%d> user code\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
     {
         user_guard ug;
-        func(arg);
+        try {
+            func(arg);
+        } catch (...) {
+            if (!group) {
+                throw;
+            }
+            error = std::current_exception();
+        }
     }    
 
     assert_interrupts_disabled();
     assert(cpu::guard == true);
-    // printf("\t\t\t\t(THREAD EXEC): cpu<%d>, thread <%d> finished stream of execution\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
+
+    // the thread may have moved to another cpu while running user code
+    cpu* self = cpu::current();
+    // printf("\t\t\t\t(THREAD EXEC): cpu<%d>, thread <%d> finished stream of execution\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
     
 
     // Move all threads that were joined back to ready queue to resume execution 
-    while (!cpu::self()->curr_thread->join_q.empty()) {
-        auto thread = cpu::self()->curr_thread->join_q.front();
-        cpu::self()->curr_thread->join_q.pop();
+    while (!self->curr_thread->join_q.empty()) {
+        auto thread = self->curr_thread->join_q.front();
+        self->curr_thread->join_q.pop();
+        deadlock_detector::clear_wait(thread->id);
         cpu::push_to_queue(thread);
     }
 
+    if (stack_watermark::enabled) {
+        stack_watermark::record(func, self->curr_thread->stk.get(), STACK_SIZE);
+    }
+
+    // The last thread of a group to finish wakes the group's joiner
+    if (group) {
+        group->thread_finished(error);
+    }
+
     // // CPU will now pick up the next available thread immediately instead of returning 
     // // to the scheduler. If no threads are available in the queue then the CPU will suspend
 
-    cpu::self()->curr_thread->status = Status::FINISHED; 
-    cpu::finished_threads.push_back(cpu::self()->curr_thread);
+    self->curr_thread->set_status(Status::FINISHED); 
+    if (self->curr_thread->final_times) {
+        *self->curr_thread->final_times = self->curr_thread->times;
+    }
+    cpu::finished_threads.push_back(self->curr_thread);
 
-    if (!cpu::ready_threads.empty()) {
-        auto finished_t             = cpu::self()->curr_thread; // will go out of scope
-        cpu::self()->curr_thread    = cpu::ready_threads.front(); // next thread to run 
-        cpu::ready_threads.pop();
+    // No local reference to the finished thread may be held past this point: this stack is
+    // never returned to, so it would never be dropped. finished_threads keeps the TCB alive
+    // until another thread frees it in cpu::clear_finished_threads()
+    if (cpu::work_for(self)) {
+        self->curr_thread    = cpu::pop_ready(); // next thread to run 
 
-        // printf("\t\t\t\t(THREAD EXEC): cpu<%d> setting thread<%d> context after becoming current thread pointer\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
+        // printf("\t\t\t\t(THREAD EXEC): cpu<%d> setting thread<%d> context after becoming current thread pointer\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
         
-        cpu::self()->curr_thread->status = Status::RUNNING;
-        setcontext(cpu::self()->curr_thread->uc.get());
+        self->curr_thread->set_status(Status::RUNNING);
+        setcontext(self->curr_thread->uc.get());
     } else {
         cpu::suspend_cpu();
     }    
@@ -98,47 +153,99 @@ void thread::thread_execution(thread_startfunc_t func, uintptr_t arg) {
 
 void thread::yield() {
     kernel_guard kg;
+    internal_yield();
+}   // thread::yield();
 
+/*
+ * internal yield: helper function to yield
+ *
+ * interrupts are disabled; used by the timer interrupt handler to preempt the current thread
+ */
+void thread::internal_yield() {
     assert_interrupts_disabled();
     assert(cpu::guard == true);
+    cpu* self = cpu::current();
 
-    // printf("\t\t\t\t(THREAD YIELD) <cpu %d thread %d> thread yielding\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
+    // printf("\t\t\t\t(THREAD YIELD) <cpu %d thread %d> thread yielding\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
     
-    assert(cpu::self()->booted);
-    assert(cpu::self()->curr_thread.get() && "Current tcb is null");
+    assert(self->booted);
+    assert(self->curr_thread.get() && "Current tcb is null");
 
-    if (!cpu::ready_threads.empty()) {
-        // // printf("\t\t\t\t(THREAD) <cpu %d thread %d> yield performing inplace swap before running\n", cpu::self()->cpu_tcb->id, cpu::self()->curr_tcb->id);
-        auto prev                   = cpu::self()->curr_thread; // current thread running
-        cpu::self()->curr_thread    = cpu::ready_threads.front(); // next thread to run 
-        cpu::ready_threads.pop();
+    if (cpu::ready_here()) {
+        // // printf("\t\t\t\t(THREAD) <cpu %d thread %d> yield performing inplace swap before running\n", cpu::current()->cpu_tcb->id, cpu::current()->curr_tcb->id);
+        auto prev                   = self->curr_thread; // current thread running
+        self->curr_thread    = cpu::pop_ready(); // next thread to run 
 
         cpu::push_to_queue(prev);
 
-        // printf("\t\t\t\t(THREAD YIELD) <cpu %d> swappping context from thread %d to thread %d\n", cpu::self()->cpu_id, prev->id, cpu::self()->curr_thread->id);
+        // printf("\t\t\t\t(THREAD YIELD) <cpu %d> swappping context from thread %d to thread %d\n", cpu::current()->cpu_id, prev->id, cpu::current()->curr_thread->id);
         
-        cpu::self()->curr_thread->status = Status::RUNNING;
-        swapcontext(prev->uc.get(), cpu::self()->curr_thread->uc.get());
+        self->curr_thread->set_status(Status::RUNNING);
+        swapcontext(prev->uc.get(), self->curr_thread->uc.get());
 
         // Whenever the yielded thread resumes its context it will clear any finished threads 
         cpu::clear_finished_threads(prev);
     } 
-    // printf("\t\t\t\t(THREAD YIELD) <cpu %d thread %d> returning from yield\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id);
-}   // thread::yield();
+    // printf("\t\t\t\t(THREAD YIELD) <cpu %d thread %d> returning from yield\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+}   // thread::internal_yield();
 
 void thread::join() {
     kernel_guard kg;
     assert_interrupts_disabled();
     assert(cpu::guard == true);
+    cpu* self = cpu::current();
 
     if(auto temp_this_thread = this_thread.lock()){
-        // printf("\t\t\t\t(THREAD JOIN): cpu<%d> thread<%d> join called by thread<%d>\n", cpu::self()->cpu_id, cpu::self()->curr_thread->id, 0);
+        // printf("\t\t\t\t(THREAD JOIN): cpu<%d> thread<%d> join called by thread<%d>\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id, 0);
     // The thread that called join will push current tcb to the join queue and block it
         if (temp_this_thread->status != Status::FINISHED) {
-            cpu::self()->curr_thread->status = Status::BLOCKED;
-            temp_this_thread->join_q.push(cpu::self()->curr_thread);
+            self->curr_thread->set_status(Status::BLOCKED);
+            temp_this_thread->join_q.push(self->curr_thread);
+            deadlock_detector::wait_thread(self->curr_thread->id, temp_this_thread->id);
 
           cpu::get_next_thread();
         } 
     }
-} // thread::join()
\ No newline at end of file
+} // thread::join()
+
+void thread::set_quantum(unsigned int ticks) {
+    kernel_guard kg;
+    assert(ticks > 0);
+
+    if (auto tcb = this_thread.lock()) {
+        tcb->quantum = ticks;
+    }
+} // thread::set_quantum()
+
+thread_times thread::times() {
+    kernel_guard kg;
+
+    if (auto tcb = this_thread.lock()) {
+        return tcb->current_times();
+    }
+    return final_times;
+} // thread::times()
+
+void thread::pin() {
+    kernel_guard kg;
+    cpu* self = cpu::current();
+    self->curr_thread->pinned = self;
+} // thread::pin()
+
+thread_times thread::self_times() {
+    kernel_guard kg;
+    return cpu::current()->curr_thread->current_times();
+} // thread::self_times()
+
+std::array<uint64_t, 64> thread::ready_wait_histogram() {
+    histogram all;
+    sched_stats::merged(sched_stats::DISPATCH_LATENCY, all);
+
+    // every histogram bucket lies within one power of two
+    std::array<uint64_t, 64> log2_hist{};
+    for (size_t i = 0; i < histogram::BUCKETS; ++i) {
+        uint64_t low = histogram::lower_bound(i);
+        log2_hist[low == 0 ? 0 : std::bit_width(low) - 1] += all.bucket_count(i);
+    }
+    return log2_hist;
+} // thread::ready_wait_histogram()
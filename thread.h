@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <array>
 #include <cstdint>
 
 #include "cpu.h"
@@ -27,11 +28,33 @@ using thread_startfunc_t = void (*)(uintptr_t);
 class thread {
 public:
     thread(thread_startfunc_t func, uintptr_t arg); // create a new thread
-    ~thread() = default;
+    ~thread();
 
     void join();                                // wait for this thread to finish
 
     static void yield();                        // yield the CPU
+
+    /*
+     * keeps the calling thread on the cpu it is running on from now on: it is only ever
+     * dispatched there, ahead of that cpu's runnext, and waking it wakes that cpu
+     */
+    static void pin();
+
+    void set_quantum(unsigned int ticks);       // set this thread's time slice, in timer interrupts
+
+    /*
+     * Time accounting: cumulative time spent running, on the ready queue, and blocked.
+     * Once the thread has finished, times() returns its final totals.
+     */
+    thread_times times();                       // times of this thread
+    static thread_times self_times();           // times of the calling thread
+
+    /*
+     * ready queue latency histogram over all threads, folded from the cpus' sched_stats
+     * DISPATCH_LATENCY histograms: bucket i counts latencies in [2^i, 2^(i+1)) nanoseconds,
+     * and bucket 0 also counts 0 ns
+     */
+    static std::array<uint64_t, 64> ready_wait_histogram();
     
     /*
     * Disable the copy constructor and copy assignment operator.
@@ -47,6 +70,24 @@ public:
     thread& operator=(thread&&);
 private: 
     friend class cpu;
+    friend class kernel_guard;
+    friend class thread_group;
+
+    /*
+     * internal yield: helper function to yield
+     *
+     * interrupts are disabled; used by the timer interrupt handler to preempt the current thread
+     */
+    static void internal_yield();
+
+    /*
+     * INVARIANT:
+     *              called with the cpu guard held
+     *
+     * creates the TCB of a new thread that will run func(arg), ready to be pushed onto the
+     * ready queue; shared by the thread constructor and thread_group::spawn()
+     */
+    static std::shared_ptr<TCB> create_tcb(thread_startfunc_t func, uintptr_t arg);
 
 
     /* 
@@ -62,9 +103,13 @@ private:
      * looks for the next available thread to run and begins its process
      *
      * otherwise, it will suspend
+     *
+     * Threads spawned by a thread_group notify the group when they finish, and 
+     * exceptions escaping func(arg) are handed to the group instead of propagating
      * 
      */
     static void thread_execution(thread_startfunc_t func, uintptr_t arg);
 
     std::weak_ptr<TCB> this_thread; // Store the TCB during thread constructor
+    thread_times final_times; // filled in by the thread when it finishes, since its TCB is freed soon after
 };
@@ -0,0 +1,76 @@
+// WORKING code for the thread_group class
+
+#include <algorithm>
+#include <cassert>
+
+#include "cpu.h"
+#include "deadlock_detector.h"
+#include "thread.h"
+#include "thread_group.h"
+
+/***************************************************************************************************
+ *                                           Thread Group                                          *
+ ***************************************************************************************************/
+
+void thread_group::spawn(thread_startfunc_t func, uintptr_t arg) {
+    kernel_guard kg;
+
+    auto tcb = thread::create_tcb(func, arg);
+
+    tcb->group = this;
+    ++outstanding;
+    unfinished.push_back(tcb->id);
+
+    // printf("\t\t\t\t(THREAD GROUP) thread<%d> spawned by cpu<%d> thread<%d>\n", tcb->id, cpu::current()->cpu_id, cpu::current()->curr_thread->id);
+    cpu::push_to_queue(tcb);
+} // thread_group::spawn()
+
+thread_group::~thread_group() {
+    kernel_guard kg;
+    assert(outstanding == 0 && "thread_group destroyed before its threads finished");
+} // thread_group::~thread_group()
+
+/*
+ * The joiner blocks at most once for the whole group; the last thread to finish
+ * in thread::thread_execution pushes it back onto the ready queue
+ *
+ * In the deadlock detector's wait-for graph the joiner waits for the oldest unfinished
+ * thread of the group, and for the next one once that finishes
+ */
+void thread_group::join_all() {
+    kernel_guard kg;
+    assert_interrupts_disabled();
+    assert(cpu::guard == true);
+    cpu* self = cpu::current();
+
+    if (outstanding != 0) {
+        assert(!joiner && "join_all() called by two threads on the same group");
+
+        self->curr_thread->set_status(Status::BLOCKED);
+        joiner = self->curr_thread;
+        deadlock_detector::wait_thread(joiner->id, unfinished.front());
+
+        cpu::get_next_thread();
+    }
+    assert(outstanding == 0);
+} // thread_group::join_all()
+
+void thread_group::thread_finished(std::exception_ptr error) {
+    assert_interrupts_disabled();
+    assert(cpu::guard == true);
+
+    if (error) {
+        errors.push_back(error);
+    }
+
+    unfinished.erase(std::find(unfinished.begin(), unfinished.end(), cpu::current()->curr_thread->id));
+
+    if (--outstanding == 0 && joiner) {
+        // printf("\t\t\t\t(THREAD GROUP): cpu<%d> thread<%d> finished last, waking joiner thread<%d>\n", cpu::current()->cpu_id, cpu::current()->curr_thread->id, joiner->id);
+        deadlock_detector::clear_wait(joiner->id);
+        cpu::push_to_queue(joiner);
+        joiner.reset();
+    } else if (joiner) {
+        deadlock_detector::wait_thread(joiner->id, unfinished.front());
+    }
+} // thread_group::thread_finished()
@@ -0,0 +1,69 @@
+/*
+ * thread_group.h -- interface to the thread_group class
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include "cpu.h"
+
+/*
+ * thread_group: a batch of threads that is joined as a whole
+ *
+ * Every thread created through spawn() decrements the group's outstanding count
+ * when its stream of execution ends. The joiner blocks once in join_all() and is
+ * woken by the last thread of the group to finish, instead of blocking and resuming
+ * once per thread as it would with thread::join().
+ *
+ * Exceptions that escape a group thread's function are captured instead of terminating
+ * the program, and can be inspected with exceptions() after join_all() returns.
+ * Results are passed back through 'arg' as with any other thread.
+ */
+class thread_group {
+public:
+    thread_group() = default;
+    ~thread_group();                                     // the group's threads must have finished
+
+    void spawn(thread_startfunc_t func, uintptr_t arg);  // create a new thread in the group
+    void join_all();                                     // wait for every thread in the group to finish
+
+    /*
+     * Exceptions thrown by the group's threads, in the order the threads finished.
+     * Only meaningful after join_all() returns.
+     */
+    const std::vector<std::exception_ptr>& exceptions() const { return errors; }
+
+    /*
+     * Disable the copy constructor, copy assignment operator, move constructor,
+     * and move assignment operator.  Running threads hold a pointer to the group.
+     */
+    thread_group(const thread_group&) = delete;
+    thread_group& operator=(const thread_group&) = delete;
+    thread_group(thread_group&&) = delete;
+    thread_group& operator=(thread_group&&) = delete;
+
+private:
+    friend class thread;
+
+    /*
+     * INVARIANT:
+     *              called by thread::thread_execution with the cpu guard held
+     *
+     * records 'error' (if any) and decrements the outstanding count; if the calling
+     * thread was the last of the group to finish, moves the joiner back to the ready queue
+     */
+    void thread_finished(std::exception_ptr error);
+
+    /*
+     * INVARIANT:
+     *              only touched with the cpu guard held
+     */
+    unsigned int outstanding = 0;               // threads spawned that have not finished
+    std::vector<uint32_t> unfinished;           // their ids, oldest first; the joiner waits for the first
+    std::shared_ptr<TCB> joiner;                // thread blocked in join_all(), if any
+    std::vector<std::exception_ptr> errors;
+};